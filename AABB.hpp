@@ -54,13 +54,13 @@ public:
 				y >= this->y && y <= this->y + this->height;
 	}
 
-	bool point_in_circle(const int x, const int y, const int cx, const int cy, const int radius) {
+	bool point_in_circle(const int x, const int y, const int cx, const int cy, const int radius) const {
 		int xd = cx - x;
 		int yd = cy - y;
 		return (xd*xd + yd*yd) <= radius*radius;
 	}
 
-	bool intersectsCircle(const int x, const int y, const int radius) {
+	bool intersectsCircle(const int x, const int y, const int radius) const {
 		const int nX = std::max(this->x, std::min(x, this->x + width)),
 							nY = std::max(this->y, std::min(y, this->y + height));
 		return point_in_circle(nX, nY, x, y, radius);
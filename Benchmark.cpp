@@ -0,0 +1,503 @@
+/**
+ * @file Benchmark.cpp
+ * @brief Runs the broadphase benchmark phases without a GUI and prints the results as JSON or CSV.
+ * @section License
+ * Copyright (C) 2020 Robert Colton
+ * License pending. All rights reserved.
+ */
+
+#include "Broadphase.hpp"
+#include "Quadtree.hpp"
+#include "SpatialHash.hpp"
+#include "PruneSweep.hpp"
+#include "DynamicAABBTree.hpp"
+#include "HierarchicalHash.hpp"
+#include "LinearBVH.hpp"
+#include "PairManager.hpp"
+#include "PartitionedBroadphase.hpp"
+#include "RangeBatch.hpp"
+#include "ThreadPool.hpp"
+#include "Trace.hpp"
+#include "UniformGrid.hpp"
+#include "Workloads.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <new>
+#include <string>
+#include <vector>
+
+// every allocation from any thread is counted, so each phase can report what it allocated
+static std::atomic<size_t> allocation_count(0);
+static std::atomic<size_t> allocated_bytes(0);
+
+// the whole replaceable set forwards here, so every form of new and delete is counted and matched
+static void* allocate(size_t size) noexcept {
+	++allocation_count;
+	allocated_bytes += size;
+	return std::malloc(size ? size : 1);
+}
+
+// kept out of line so GCC does not pair an inlined free with the operator new call it sees
+#if defined(__GNUC__)
+__attribute__((noinline))
+#endif
+static void release(void* p) noexcept {
+	std::free(p);
+}
+
+void* operator new(size_t size) {
+	if (void* p = allocate(size)) return p;
+	throw std::bad_alloc();
+}
+
+void* operator new[](size_t size) {
+	if (void* p = allocate(size)) return p;
+	throw std::bad_alloc();
+}
+
+void* operator new(size_t size, const std::nothrow_t&) noexcept { return allocate(size); }
+void* operator new[](size_t size, const std::nothrow_t&) noexcept { return allocate(size); }
+
+void operator delete(void* p) noexcept { release(p); }
+void operator delete[](void* p) noexcept { release(p); }
+void operator delete(void* p, size_t) noexcept { release(p); }
+void operator delete[](void* p, size_t) noexcept { release(p); }
+void operator delete(void* p, const std::nothrow_t&) noexcept { release(p); }
+void operator delete[](void* p, const std::nothrow_t&) noexcept { release(p); }
+
+struct Options {
+	size_t count = 10000;
+	int world = 1024;
+	std::string distribution = "uniform";
+	size_t sweep = 0; // largest count of a sweep, or 0 for a single count
+	std::string only; // benchmark only the backends whose names contain this
+	std::string record, replay; // trace files
+	unsigned seed = 1;
+	unsigned threads = 1;
+	int runs = 5;
+	int frames = 60;
+	int queries = 100;
+	bool csv = false;
+};
+
+static WorkloadRandom rng(1);
+
+static int randomInt(int low, int high) {
+	return rng.range(low, high);
+}
+
+// the timings of one phase in microseconds and what each run of it allocated
+struct Phase {
+	const char* name;
+	std::vector<double> times;
+	double allocations = 0, bytes = 0; // per run on average
+#ifdef BROADPHASE_STATS
+	BroadphaseStats stats; // counts per run on average, bytes as of the last run
+#endif
+
+	double mean() const {
+		double sum = 0;
+		for (auto time : times) sum += time;
+		return times.empty() ? 0 : sum / times.size();
+	}
+
+	// nearest rank, so the p99 of only a few runs is their slowest
+	double percentile(const double p) const {
+		if (times.empty()) return 0;
+		std::vector<double> sorted(times);
+		std::sort(sorted.begin(), sorted.end());
+		const size_t rank = (size_t) std::ceil(p * sorted.size());
+		return sorted[std::max<size_t>(rank, 1) - 1];
+	}
+};
+
+// the broadphase whose query statistics the timed runs collect
+static Broadphase* measured = nullptr;
+
+/**
+ * Times fnc over the given number of runs with pre and post run around each one untimed. The rng is
+ * reseeded before every run so they all see the same random queries.
+ */
+static Phase benchmark(const char* name, const Options& options, const std::function<void()>& fnc,
+											 const std::function<void()>& pre = [](){}, const std::function<void()>& post = [](){}) {
+	Phase phase;
+	phase.name = name;
+	for (int i = 0; i < options.runs; ++i) {
+		rng = WorkloadRandom(options.seed + 1);
+		pre();
+#ifdef BROADPHASE_STATS
+		if (measured) measured->resetStats();
+#endif
+		const size_t allocations = allocation_count, bytes = allocated_bytes;
+		const auto start = std::chrono::high_resolution_clock::now();
+		fnc();
+		const auto end = std::chrono::high_resolution_clock::now();
+#ifdef BROADPHASE_STATS
+		if (measured) {
+			const BroadphaseStats stats = measured->getStats();
+			phase.stats.add(stats);
+			phase.stats.liveBytes = stats.liveBytes;
+			phase.stats.peakBytes = stats.peakBytes;
+		}
+#endif
+		phase.allocations += (double) (allocation_count - allocations) / options.runs;
+		phase.bytes += (double) (allocated_bytes - bytes) / options.runs;
+		phase.times.push_back(std::chrono::duration<double, std::micro>(end - start).count());
+		post();
+	}
+	return phase;
+}
+
+struct Backend {
+	const char* name;
+	std::function<Broadphase*(const Options&)> create;
+};
+
+static std::vector<Phase> benchmarkBroadphase(Broadphase& broadphase, const Workload& workload,
+																							const Options& options, ThreadPool& threads) {
+	std::vector<Phase> phases;
+	const auto& aabbs = workload.aabbs;
+	measured = &broadphase;
+	// the proxies a backend accepted and the workload box each one came from
+	std::vector<Broadphase::Proxy*> proxies;
+	std::vector<size_t> boxes;
+
+	auto fill = [&]() {
+		broadphase.clear();
+		std::vector<Broadphase::Proxy*>().swap(proxies);
+		boxes.clear();
+		for (size_t i = 0; i < aabbs.size(); ++i) {
+			auto proxy = broadphase.addProxy(aabbs[i]);
+			if (!proxy) continue;
+			proxies.push_back(proxy);
+			boxes.push_back(i);
+		}
+	};
+	// the partitioned backend has to be told where frames end to put idle proxies to sleep, and the
+	// rebuilt backends rebuild over the pool once a frame rather than lazily on their first query,
+	// and sweep and prune merges the boxes it was given in the same place
+	const auto partitioned = dynamic_cast<PartitionedBroadphase<SpatialHash>*>(&broadphase);
+	const auto grid = dynamic_cast<UniformGrid*>(&broadphase);
+	const auto bvh = dynamic_cast<LinearBVH*>(&broadphase);
+	const auto sweep = dynamic_cast<PruneSweep*>(&broadphase);
+	auto rebuild = [&]() {
+		if (grid) grid->rebuild(threads);
+		if (bvh) bvh->rebuild(threads);
+		if (sweep) sweep->rebuild();
+	};
+	auto move = [&](const unsigned frame, const std::function<void(Broadphase::Proxy*, const AABB&)>& update) {
+		for (size_t i = 0; i < proxies.size(); ++i) {
+			if (!workload.isMoving(boxes[i])) continue;
+			update(proxies[i], workload.move(boxes[i], proxies[i]->aabb, frame));
+		}
+		if (partitioned) partitioned->step();
+		rebuild();
+	};
+
+	phases.push_back(benchmark("insert", options, [&]() {
+			for (const auto& aabb : aabbs)
+				broadphase.addProxy(aabb);
+			rebuild();
+		},
+		[&]() { broadphase.clear(); }
+	));
+
+	const int maxRadius = std::max(2, options.world * 240 / 1024);
+	std::vector<Broadphase::Proxy*> hits;
+	phases.push_back(benchmark("query", options, [&]() {
+			for (int i = 0; i < options.queries; ++i) {
+				hits.clear();
+				broadphase.queryRange(randomInt(0, options.world),
+															randomInt(0, options.world),
+															randomInt(2, maxRadius), hits);
+			}
+		}
+	));
+
+	// the same queries spread over the thread pool
+	RangeBatch batch;
+	phases.push_back(benchmark("batch", options, [&]() {
+			batch.run(static_cast<const Broadphase&>(broadphase), threads);
+		},
+		[&]() {
+			batch.clear();
+			for (int i = 0; i < options.queries; ++i)
+				batch.addQuery(randomInt(0, options.world),
+											 randomInt(0, options.world),
+											 randomInt(2, maxRadius));
+		}
+	));
+
+	// only the spatial hash finds its pairs in parallel
+	const auto hash = dynamic_cast<SpatialHash*>(&broadphase);
+	std::vector<Broadphase::ProxyPair> pairs;
+	phases.push_back(benchmark("pairs", options, [&]() {
+			pairs.clear();
+			if (hash) hash->queryCollisionPairs(pairs, threads);
+			else broadphase.queryCollisionPairs(pairs);
+		}
+	));
+
+	phases.push_back(benchmark("update", options, [&]() {
+			for (int i = 0; i < options.frames; ++i)
+				move(i, [&](Broadphase::Proxy* proxy, const AABB& aabb) { broadphase.updateProxy(proxy, aabb); });
+		},
+		fill
+	));
+
+	// the same motion through a pair manager, which only retests what moved
+	PairManager manager(broadphase);
+	std::vector<PairManager::Contact> began, ended;
+	phases.push_back(benchmark("contacts", options, [&]() {
+			for (int i = 0; i < options.frames; ++i) {
+				move(i, [&](Broadphase::Proxy* proxy, const AABB& aabb) { manager.updateProxy(proxy, aabb); });
+				began.clear();
+				ended.clear();
+				manager.update(began, ended);
+			}
+		},
+		[&]() {
+			manager.clear();
+			std::vector<Broadphase::Proxy*>().swap(proxies);
+			boxes.clear();
+			for (size_t i = 0; i < aabbs.size(); ++i) {
+				auto proxy = manager.addProxy(aabbs[i]);
+				if (!proxy) continue;
+				proxies.push_back(proxy);
+				boxes.push_back(i);
+			}
+			manager.update(began, ended);
+		}
+	));
+
+	phases.push_back(benchmark("clear", options, [&]() { broadphase.clear(); }, fill));
+
+	phases.push_back(benchmark("remove", options, [&]() {
+			for (auto proxy : proxies)
+				broadphase.removeProxy(proxy);
+		},
+		fill
+	));
+	broadphase.clear();
+	measured = nullptr;
+	return phases;
+}
+
+static void printUsage(const char* program) {
+	std::fprintf(stderr,
+		"usage: %s [options]\n"
+		"  --count N          number of proxies (default 10000)\n"
+		"  --world N          width and height of the world (default 1024)\n"
+		"  --distribution D   uniform, sparse, gaussian, heavy, corridors, static or teleport\n"
+		"                     (default uniform)\n"
+		"  --sweep N          run counts from 1000 up to N in 1, 2, 5 steps, scaling the world\n"
+		"                     to keep the density of 10000 proxies in 1024\n"
+		"  --backends S       only the backends whose names contain S, e.g. Hash\n"
+		"  --seed N           random seed (default 1)\n"
+		"  --threads N        worker threads for batch queries and pairs, 0 for all (default 1)\n"
+		"  --runs N           timed runs per phase (default 5)\n"
+		"  --frames N         frames of motion per update run (default 60)\n"
+		"  --queries N        range queries per query run (default 100)\n"
+		"  --format F         json or csv (default json)\n"
+		"  --record FILE      write a trace of the workload moving for the given frames, each frame\n"
+		"                     running the queries and a pair query, instead of benchmarking\n"
+		"  --replay FILE      time a trace against every backend, per operation and per frame,\n"
+		"                     where count is the operations of a kind and allocations are only\n"
+		"                     counted for the whole replay\n", program);
+}
+
+static bool parseOptions(int argc, char *argv[], Options& options) {
+	for (int i = 1; i < argc; ++i) {
+		const std::string arg = argv[i];
+		if (i + 1 >= argc) return false;
+		const char* value = argv[++i];
+		if (arg == "--count") options.count = std::strtoul(value, nullptr, 10);
+		else if (arg == "--world") options.world = std::atoi(value);
+		else if (arg == "--distribution") options.distribution = value;
+		else if (arg == "--backends") options.only = value;
+		else if (arg == "--record") options.record = value;
+		else if (arg == "--replay") options.replay = value;
+		else if (arg == "--sweep") options.sweep = std::strtoul(value, nullptr, 10);
+		else if (arg == "--seed") options.seed = (unsigned) std::strtoul(value, nullptr, 10);
+		else if (arg == "--threads") options.threads = (unsigned) std::strtoul(value, nullptr, 10);
+		else if (arg == "--runs") options.runs = std::atoi(value);
+		else if (arg == "--frames") options.frames = std::atoi(value);
+		else if (arg == "--queries") options.queries = std::atoi(value);
+		else if (arg == "--format") {
+			if (std::strcmp(value, "csv") == 0) options.csv = true;
+			else if (std::strcmp(value, "json") == 0) options.csv = false;
+			else return false;
+		}
+		else return false;
+	}
+	const auto names = Workload::names();
+	return options.world > 0 && options.runs > 0 &&
+				 std::find(names.begin(), names.end(), options.distribution) != names.end();
+}
+
+static void printResult(const Options& options, bool& first, const size_t count, const int world,
+												const char* backend, const Phase& phase, const double bytes) {
+	if (options.csv) {
+		std::printf("%zu,%d,%s,%s,%.2f,%.2f,%.2f,%.1f,%.0f", count, world, backend, phase.name,
+								phase.mean(), phase.percentile(0.5), phase.percentile(0.99), phase.allocations, bytes);
+	} else {
+		std::printf("%s\n    {\"count\": %zu, \"world\": %d, \"backend\": \"%s\", \"phase\": \"%s\", "
+								"\"mean_us\": %.2f, \"median_us\": %.2f, \"p99_us\": %.2f, \"allocations\": %.1f, "
+								"\"allocated_bytes\": %.0f",
+								first ? "" : ",", count, world, backend, phase.name,
+								phase.mean(), phase.percentile(0.5), phase.percentile(0.99), phase.allocations, bytes);
+	}
+#ifdef BROADPHASE_STATS
+	// the counts of all runs averaged, the occupancy and bytes as they were
+	const BroadphaseStats& stats = phase.stats;
+	const double runs = options.runs;
+	std::printf(options.csv ? ",%.1f,%.1f,%.1f,%.1f,%.1f,%.1f,%llu,%zu,%zu" :
+							", \"stats\": {\"queries\": %.1f, \"nodes\": %.1f, \"cells\": %.1f, \"tests\": %.1f, "
+							"\"hits\": %.1f, \"duplicates\": %.1f, \"max_occupancy\": %llu, \"live_bytes\": %zu, "
+							"\"peak_bytes\": %zu}",
+							stats.queries / runs, stats.nodes / runs, stats.cells / runs, stats.tests / runs,
+							stats.hits / runs, stats.duplicates / runs, (unsigned long long) stats.maxOccupancy,
+							stats.liveBytes, stats.peakBytes);
+#endif
+	std::printf(options.csv ? "\n" : "}");
+	std::fflush(stdout);
+	first = false;
+}
+
+// plays the workload into a trace the way a game loop would drive the broadphase
+static bool recordWorkload(const Options& options) {
+	const Workload workload = Workload::create(options.distribution, options.count, options.world, options.seed);
+	SpatialHash hash;
+	TraceRecorder recorder(hash);
+	recorder.start();
+	std::vector<Broadphase::Proxy*> proxies;
+	for (const auto& aabb : workload.aabbs)
+		proxies.push_back(recorder.addProxy(aabb));
+
+	rng = WorkloadRandom(options.seed + 1);
+	const int maxRadius = std::max(2, options.world * 240 / 1024);
+	std::vector<Broadphase::Proxy*> hits;
+	std::vector<Broadphase::ProxyPair> pairs;
+	for (int frame = 0; frame < options.frames; ++frame) {
+		for (size_t i = 0; i < proxies.size(); ++i)
+			if (workload.isMoving(i)) recorder.updateProxy(proxies[i], workload.move(i, proxies[i]->aabb, frame));
+		for (int i = 0; i < options.queries; ++i) {
+			hits.clear();
+			recorder.queryRange(randomInt(0, options.world), randomInt(0, options.world), randomInt(2, maxRadius), hits);
+		}
+		pairs.clear();
+		recorder.queryCollisionPairs(pairs);
+		recorder.endFrame();
+	}
+	recorder.stop();
+	if (!recorder.save(options.record)) return false;
+	std::fprintf(stderr, "recorded %d frames of %zu proxies in %zu bytes\n",
+							 options.frames, proxies.size(), recorder.getTrace().size());
+	return true;
+}
+
+int main(int argc, char *argv[])
+{
+	Options options;
+	if (!parseOptions(argc, argv, options)) {
+		printUsage(argv[0]);
+		return 1;
+	}
+	if (!options.record.empty()) {
+		if (recordWorkload(options)) return 0;
+		std::fprintf(stderr, "could not write %s\n", options.record.c_str());
+		return 1;
+	}
+	TraceReplay trace;
+	if (!options.replay.empty() && !trace.load(options.replay)) {
+		std::fprintf(stderr, "could not read %s\n", options.replay.c_str());
+		return 1;
+	}
+	const std::vector<Backend> backends = {
+		{"Prune Sweep", [](const Options&) -> Broadphase* { return new PruneSweep(); }},
+		{"Quadtree", [](const Options& o) -> Broadphase* { return new Quadtree(o.world, o.world); }},
+		{"Loose Quadtree", [](const Options& o) -> Broadphase* { return new Quadtree(o.world, o.world, 8, 2.0f); }},
+		{"Spatial Hash", [](const Options&) -> Broadphase* { return new SpatialHash(); }},
+		{"Dynamic AABB Tree", [](const Options&) -> Broadphase* { return new DynamicAABBTree(); }},
+		{"Partitioned Spatial Hash", [](const Options&) -> Broadphase* { return new PartitionedBroadphase<SpatialHash>(); }},
+		{"Uniform Grid", [](const Options& o) -> Broadphase* { return new UniformGrid(o.world, o.world); }},
+		{"Linear BVH", [](const Options&) -> Broadphase* { return new LinearBVH(); }},
+		{"Hierarchical Hash", [](const Options&) -> Broadphase* { return new HierarchicalHash(); }},
+	};
+
+	ThreadPool threads(options.threads);
+	const std::vector<size_t> counts = options.sweep ?
+		Workload::sweepCounts(1000, options.sweep) : std::vector<size_t>(1, options.count);
+
+	if (options.csv) {
+		std::printf("count,world,backend,phase,mean_us,median_us,p99_us,allocations,allocated_bytes");
+#ifdef BROADPHASE_STATS
+		std::printf(",queries,nodes,cells,tests,hits,duplicates,max_occupancy,live_bytes,peak_bytes");
+#endif
+		std::printf("\n");
+	} else {
+		std::printf("{\n  \"distribution\": \"%s\",\n  \"seed\": %u,\n  \"threads\": %u,\n  \"runs\": %d,\n"
+								"  \"results\": [", options.distribution.c_str(), options.seed, threads.size(), options.runs);
+	}
+
+	bool first = true;
+	if (!options.replay.empty()) {
+		for (const auto& backend : backends) {
+			if (std::string(backend.name).find(options.only) == std::string::npos) continue;
+			std::unique_ptr<Broadphase> broadphase(backend.create(options));
+			TraceReplay::Result result;
+			measured = broadphase.get();
+			const Phase total = benchmark("replay", options, [&]() {
+				if (!trace.replay(*broadphase, result)) {
+					std::fprintf(stderr, "%s is not a valid trace\n", options.replay.c_str());
+					std::exit(1);
+				}
+			});
+			measured = nullptr;
+			broadphase->clear();
+			std::fprintf(stderr, "%s: %zu hits per replay\n", backend.name, result.hits / options.runs);
+
+			for (int op = 0; op < Trace::OpCount; ++op) {
+				Phase phase;
+				phase.name = Trace::getOpName((Trace::Op) op);
+				phase.times.swap(op == Trace::Frame ? result.frames : result.times[op]);
+				if (!phase.times.empty())
+					printResult(options, first, phase.times.size() / options.runs, options.world, backend.name, phase, 0);
+			}
+			printResult(options, first, 1, options.world, backend.name, total, total.bytes);
+		}
+		if (!options.csv) std::printf("\n  ]\n}\n");
+		return 0;
+	}
+
+	for (auto count : counts) {
+		Options config = options;
+		config.count = count;
+		if (options.sweep) config.world = Workload::scaledWorld(count);
+		const Workload workload = Workload::create(config.distribution, count, config.world, config.seed);
+
+		for (const auto& backend : backends) {
+			if (std::string(backend.name).find(options.only) == std::string::npos) continue;
+			// what the empty backend itself costs goes into its insert phase's footprint
+			const size_t before = allocated_bytes;
+			std::unique_ptr<Broadphase> broadphase(backend.create(config));
+			const size_t baseBytes = allocated_bytes - before;
+
+			for (const auto& phase : benchmarkBroadphase(*broadphase, workload, config, threads)) {
+				const double bytes = phase.bytes + (std::strcmp(phase.name, "insert") == 0 ? baseBytes : 0);
+				printResult(options, first, count, config.world, backend.name, phase, bytes);
+			}
+		}
+	}
+
+	if (!options.csv) std::printf("\n  ]\n}\n");
+	return 0;
+}
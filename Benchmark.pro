@@ -0,0 +1,38 @@
+#-------------------------------------------------
+#
+# Headless benchmark, builds without Qt
+#
+#-------------------------------------------------
+
+CONFIG += console c++11
+CONFIG -= qt app_bundle
+
+# vectorized bounds tests, add -mavx2 for 8 wide kernels or define BROADPHASE_SCALAR to opt out
+!msvc:if(contains(QT_ARCH, x86_64)|contains(QT_ARCH, i386)): QMAKE_CXXFLAGS += -msse4.1
+unix: LIBS += -pthread
+
+TARGET = Benchmark
+TEMPLATE = app
+
+
+SOURCES += Benchmark.cpp
+
+HEADERS  += \
+    AABB.hpp \
+    Broadphase.hpp \
+    CellTable.hpp \
+    DynamicAABBTree.hpp \
+    HierarchicalHash.hpp \
+    LinearBVH.hpp \
+    PairManager.hpp \
+    PartitionedBroadphase.hpp \
+    Pool.hpp \
+    ProxyBatch.hpp \
+    PruneSweep.hpp \
+    Quadtree.hpp \
+    RangeBatch.hpp \
+    SpatialHash.hpp \
+    ThreadPool.hpp \
+    Trace.hpp \
+    UniformGrid.hpp \
+    Workloads.hpp
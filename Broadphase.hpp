@@ -10,9 +10,63 @@
 #define BROADPHASE_HPP
 
 #include "AABB.hpp"
+#include "Pool.hpp"
 
+#include <algorithm>
+#include <cassert>
+#include <cstdint>
+#include <type_traits>
+#include <utility>
 #include <vector>
 
+#ifdef BROADPHASE_STATS
+#include <mutex>
+#endif
+
+/*
+ * Query Statistics
+ *
+ * Building with BROADPHASE_STATS defined makes every query count the work it does into a scope on
+ * the querying thread, which is added to the broadphase's totals under a lock once the query ends.
+ * A query running inside another, like the dynamic backend queried by a partitioned one, counts
+ * towards the outermost query. Without the define the counting macros expand to nothing.
+ */
+
+struct BroadphaseStats {
+	uint64_t queries = 0;
+	uint64_t nodes = 0; // tree nodes visited
+	uint64_t cells = 0; // hash cells looked up
+	uint64_t tests = 0; // box and circle tests, every lane of a vectorized test included
+	uint64_t hits = 0; // tests that passed
+	uint64_t duplicates = 0; // hits dropped because they are reported from another cell or leaf
+	uint64_t maxOccupancy = 0; // most proxies in one cell, node or leaf visited
+	size_t liveBytes = 0; // storage holding the current proxies
+	size_t peakBytes = 0; // storage reserved at most, which the backends keep until destroyed
+
+	void add(const BroadphaseStats& other) {
+		queries += other.queries;
+		nodes += other.nodes;
+		cells += other.cells;
+		tests += other.tests;
+		hits += other.hits;
+		duplicates += other.duplicates;
+		maxOccupancy = std::max(maxOccupancy, other.maxOccupancy);
+	}
+};
+
+#ifdef BROADPHASE_STATS
+#define BROADPHASE_STATS_SCOPE() const Broadphase::StatsScope statsScope(*this)
+#define BROADPHASE_COUNT(field, amount) \
+	do { if (BroadphaseStats* stats_ = Broadphase::StatsScope::current()) stats_->field += (amount); } while (0)
+#define BROADPHASE_OCCUPANCY(count) \
+	do { if (BroadphaseStats* stats_ = Broadphase::StatsScope::current()) \
+		stats_->maxOccupancy = std::max<uint64_t>(stats_->maxOccupancy, (count)); } while (0)
+#else
+#define BROADPHASE_STATS_SCOPE()
+#define BROADPHASE_COUNT(field, amount)
+#define BROADPHASE_OCCUPANCY(count)
+#endif
+
 class Broadphase {
 protected:
 	Broadphase() {}
@@ -21,16 +75,195 @@ public:
 	struct Proxy {
 		void* userdata;
 		AABB aabb;
+		int index = -1; // bookkeeping slot owned by the broadphase holding the proxy
+		uint32_t id = 0; // slot in the handle table
 		Proxy(void* userdata = nullptr): userdata(userdata) {}
 		Proxy(const AABB& aabb, void* userdata = nullptr): userdata(userdata), aabb(aabb) {}
 	};
 
-	virtual ~Broadphase() {}
+	/**
+	 * A stable reference to a proxy. The generation is bumped every time a handle slot is freed,
+	 * so a handle kept past its proxy's removal stops resolving instead of dangling.
+	 */
+	struct Handle {
+		uint32_t index = UINT32_MAX;
+		uint32_t generation = 0;
+
+		friend inline bool operator==(const Handle& lhs, const Handle& rhs) {
+			return lhs.index == rhs.index && lhs.generation == rhs.generation;
+		}
+		friend inline bool operator!=(const Handle& lhs, const Handle& rhs) {
+			return !(lhs == rhs);
+		}
+	};
+
+	typedef std::pair<Proxy*, Proxy*> ProxyPair;
+	typedef std::pair<uint32_t, uint32_t> IdPair;
+
+	// receives each hit of a query and returns false to stop the query early
+	typedef bool (*QueryCallback)(Proxy* proxy, void* context);
+	// receives each overlapping pair and returns false to stop early
+	typedef bool (*PairCallback)(Proxy* a, Proxy* b, void* context);
+	// receives a cell or node, how many proxies it holds itself and how deep it sits in the hierarchy
+	typedef void (*StructureCallback)(const AABB& bounds, size_t count, int depth, void* context);
+
+private:
+	struct HandleSlot {
+		Proxy* proxy;
+		uint32_t generation;
+		uint32_t live; // position in the live array, or the next free slot while unused
+	};
+
+	std::vector<HandleSlot> handles;
+	uint32_t freeHandle = UINT32_MAX;
+	std::vector<Proxy*> live;
+
+protected:
+	// every proxy a broadphase owns comes from here, so clearing can release them all at once
+	Pool<Proxy> proxyPool;
+
+	// hands out a proxy from the pool with a fresh handle slot, not yet in the index
+	Proxy* createProxy(const AABB& aabb, void* userdata = nullptr) {
+		Proxy* proxy = proxyPool.create(aabb, userdata);
+		uint32_t id = freeHandle;
+		if (id == UINT32_MAX) {
+			id = (uint32_t) handles.size();
+			handles.push_back(HandleSlot{nullptr, 0, 0});
+		} else {
+			freeHandle = handles[id].live;
+		}
+		handles[id].proxy = proxy;
+		handles[id].live = (uint32_t) live.size();
+		live.push_back(proxy);
+		proxy->id = id;
+		return proxy;
+	}
+
+	/**
+	 * Puts a proxy into the index. Only the broadphase's own proxies from createProxy() and proxies
+	 * linked in from another broadphase arrive here, so callers outside never hand in one it does
+	 * not know about.
+	 */
 	virtual Proxy* addProxy(Proxy* proxy) = 0;
+
+	void destroyProxy(Proxy* proxy) {
+		// a proxy another broadphase owns would free someone else's handle slot
+		assert(proxy->id < handles.size() && handles[proxy->id].proxy == proxy);
+		HandleSlot& slot = handles[proxy->id];
+		Proxy* last = live.back();
+		live[slot.live] = last;
+		handles[last->id].live = slot.live;
+		live.pop_back();
+
+		slot.proxy = nullptr;
+		++slot.generation;
+		slot.live = freeHandle;
+		freeHandle = proxy->id;
+		proxyPool.destroy(proxy);
+	}
+
+	// frees every proxy at once for clear()
+	void releaseProxies() {
+		for (auto proxy : live) {
+			HandleSlot& slot = handles[proxy->id];
+			slot.proxy = nullptr;
+			++slot.generation;
+			slot.live = freeHandle;
+			freeHandle = proxy->id;
+		}
+		live.clear();
+		proxyPool.clear();
+	}
+
+#ifdef BROADPHASE_STATS
+	mutable std::mutex statsMutex;
+	mutable BroadphaseStats totalStats, lastStats;
+
+	void commitStats(const BroadphaseStats& stats) const {
+		std::lock_guard<std::mutex> lock(statsMutex);
+		totalStats.add(stats);
+		lastStats = stats;
+	}
+
+public:
+	// collects the counts of one query, or nothing when another query on this thread already is
+	class StatsScope {
+		struct Counter {
+			BroadphaseStats stats;
+			int depth = 0; // scopes open on this thread
+		};
+
+		const Broadphase& broadphase;
+
+		static Counter& counter() {
+			static thread_local Counter counter;
+			return counter;
+		}
+
+	public:
+		// the counts of the query running on this thread, if any
+		static BroadphaseStats* current() {
+			Counter& counter = StatsScope::counter();
+			return counter.depth ? &counter.stats : nullptr;
+		}
+
+		explicit StatsScope(const Broadphase& broadphase): broadphase(broadphase) {
+			Counter& counter = StatsScope::counter();
+			if (counter.depth++) return;
+			counter.stats = BroadphaseStats();
+			counter.stats.queries = 1;
+		}
+
+		~StatsScope() {
+			Counter& counter = StatsScope::counter();
+			if (!--counter.depth) broadphase.commitStats(counter.stats);
+		}
+
+		StatsScope(const StatsScope&) = delete;
+		StatsScope& operator=(const StatsScope&) = delete;
+	};
+
+	// the totals of every query since the last reset, with the current storage
+	BroadphaseStats getStats() const {
+		BroadphaseStats stats;
+		size_t reserved = 0;
+		measureMemory(stats.liveBytes, reserved);
+		std::lock_guard<std::mutex> lock(statsMutex);
+		totalStats.peakBytes = std::max(totalStats.peakBytes, reserved);
+		stats.add(totalStats);
+		stats.peakBytes = totalStats.peakBytes;
+		return stats;
+	}
+
+	// the counts of whichever query finished last, on any thread
+	BroadphaseStats getLastQueryStats() const {
+		std::lock_guard<std::mutex> lock(statsMutex);
+		return lastStats;
+	}
+
+	void resetStats() {
+		std::lock_guard<std::mutex> lock(statsMutex);
+		totalStats = lastStats = BroadphaseStats();
+	}
+
+	/**
+	 * Adds up the bytes used by the current proxies and the bytes reserved for them. Backends add
+	 * their own structures to the proxy and handle storage counted here.
+	 */
+	virtual void measureMemory(size_t& used, size_t& reserved) const {
+		used += live.size() * (sizeof(Proxy) + sizeof(Proxy*)) + handles.size() * sizeof(HandleSlot);
+		reserved += proxyPool.reservedBytes() + live.capacity() * sizeof(Proxy*) +
+								handles.capacity() * sizeof(HandleSlot);
+	}
+#endif
+
+public:
+	virtual ~Broadphase() {}
+
 	virtual Proxy* addProxy(const AABB& aabb, void* userdata = 0) {
-		Proxy* proxy = new Proxy(aabb, userdata);
+		Proxy* proxy = createProxy(aabb, userdata);
 		Proxy* res = addProxy(proxy);
-		if (!res) delete proxy;
+		if (!res) destroyProxy(proxy);
 		return res;
 	}
 	virtual void removeProxy(Proxy* proxy, bool free = true) = 0;
@@ -40,7 +273,128 @@ public:
 		addProxy(proxy);
 	}
 	virtual void clear() = 0;
-	virtual std::vector<Proxy*> queryRange(const int x, const int y, const int radius) = 0;
+
+	/**
+	 * Indexes a proxy owned by another broadphase, the way a composite backend keeps its proxies in
+	 * an inner one. The proxy is never freed here, its owner unlinks it before freeing it, and while
+	 * it is linked its index belongs to this broadphase.
+	 */
+	Proxy* linkProxy(Proxy* proxy) { return addProxy(proxy); }
+	void unlinkProxy(Proxy* proxy) { removeProxy(proxy, false); }
+
+	/**
+	 * Queries come in three forms. The buffer form appends the hits to a vector the caller keeps
+	 * around between queries, so a warm buffer never allocates. The callback form hands each hit to
+	 * the callback and returns false if the callback stopped it early. visitRange() wraps any functor
+	 * in a callback, and every backend hides it with a native template that inlines the functor.
+	 */
+	virtual void queryRange(const int x, const int y, const int radius, std::vector<Proxy*>& hits) const = 0;
+	virtual bool queryRange(const int x, const int y, const int radius, QueryCallback callback, void* context) const = 0;
+
+	std::vector<Proxy*> queryRange(const int x, const int y, const int radius) const {
+		std::vector<Proxy*> hits;
+		queryRange(x, y, radius, hits);
+		return hits;
+	}
+
+	template<typename Visitor>
+	bool visitRange(const int x, const int y, const int radius, Visitor&& visit) const {
+		typedef typename std::remove_reference<Visitor>::type Functor;
+		return queryRange(x, y, radius, [](Proxy* proxy, void* context) {
+			return (bool) (*static_cast<Functor*>(context))(proxy);
+		}, const_cast<void*>(static_cast<const void*>(&visit)));
+	}
+
+	// the same three forms for every proxy whose AABB overlaps the given one
+	virtual void queryAABB(const AABB& aabb, std::vector<Proxy*>& hits) const = 0;
+	virtual bool queryAABB(const AABB& aabb, QueryCallback callback, void* context) const = 0;
+
+	std::vector<Proxy*> queryAABB(const AABB& aabb) const {
+		std::vector<Proxy*> hits;
+		queryAABB(aabb, hits);
+		return hits;
+	}
+
+	template<typename Visitor>
+	bool visitAABB(const AABB& aabb, Visitor&& visit) const {
+		typedef typename std::remove_reference<Visitor>::type Functor;
+		return queryAABB(aabb, [](Proxy* proxy, void* context) {
+			return (bool) (*static_cast<Functor*>(context))(proxy);
+		}, const_cast<void*>(static_cast<const void*>(&visit)));
+	}
+
+	/**
+	 * Reports every pair of proxies whose AABBs overlap exactly once, in no particular order. Each
+	 * backend rules out duplicates by construction instead of hashing the pairs it finds, and like
+	 * the range queries there is a buffer form, a callback form and a visitPairs() template.
+	 */
+	virtual void queryCollisionPairs(std::vector<ProxyPair>& pairs) const = 0;
+	virtual bool queryCollisionPairs(PairCallback callback, void* context) const = 0;
+
+	std::vector<ProxyPair> queryCollisionPairs() const {
+		std::vector<ProxyPair> pairs;
+		queryCollisionPairs(pairs);
+		return pairs;
+	}
+
+	template<typename Visitor>
+	bool visitPairs(Visitor&& visit) const {
+		typedef typename std::remove_reference<Visitor>::type Functor;
+		return queryCollisionPairs([](Proxy* a, Proxy* b, void* context) {
+			return (bool) (*static_cast<Functor*>(context))(a, b);
+		}, const_cast<void*>(static_cast<const void*>(&visit)));
+	}
+
+	/**
+	 * Walks the cells or nodes a backend divides space into, for drawing and inspecting it. Backends
+	 * without a spatial structure of their own report nothing.
+	 */
+	virtual void queryStructure(StructureCallback callback, void* context) const {
+		(void) callback;
+		(void) context;
+	}
+
+	template<typename Visitor>
+	void visitStructure(Visitor&& visit) const {
+		typedef typename std::remove_reference<Visitor>::type Functor;
+		queryStructure([](const AABB& bounds, size_t count, int depth, void* context) {
+			(*static_cast<Functor*>(context))(bounds, count, depth);
+		}, const_cast<void*>(static_cast<const void*>(&visit)));
+	}
+
+	Handle getHandle(const Proxy* proxy) const {
+		Handle handle;
+		handle.index = proxy->id;
+		handle.generation = handles[proxy->id].generation;
+		return handle;
+	}
+
+	// null once the proxy behind the handle has been removed
+	Proxy* getProxy(const Handle handle) const {
+		if (handle.index >= handles.size()) return nullptr;
+		const HandleSlot& slot = handles[handle.index];
+		return slot.generation == handle.generation ? slot.proxy : nullptr;
+	}
+
+	bool isValid(const Handle handle) const {
+		return getProxy(handle) != nullptr;
+	}
+
+	Handle addHandle(const AABB& aabb, void* userdata = nullptr) {
+		Proxy* proxy = addProxy(aabb, userdata);
+		return proxy ? getHandle(proxy) : Handle();
+	}
+
+	void removeHandle(const Handle handle) {
+		if (Proxy* proxy = getProxy(handle)) removeProxy(proxy);
+	}
+
+	void updateHandle(const Handle handle, const AABB& aabb) {
+		if (Proxy* proxy = getProxy(handle)) updateProxy(proxy, aabb);
+	}
+
+	// every live proxy, packed for linear iteration
+	const std::vector<Proxy*>& getProxies() const { return live; }
 };
 
 #endif // BROADPHASE_HPP
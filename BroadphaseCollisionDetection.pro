@@ -7,6 +7,9 @@
 QT       += core gui
 CONFIG += c++11
 
+# vectorized bounds tests, add -mavx2 for 8 wide kernels or define BROADPHASE_SCALAR to opt out
+!msvc:if(contains(QT_ARCH, x86_64)|contains(QT_ARCH, i386)): QMAKE_CXXFLAGS += -msse4.1
+
 greaterThan(QT_MAJOR_VERSION, 4): QT += widgets
 
 TARGET = BroadphaseCollisionDetection
@@ -19,9 +22,22 @@ SOURCES += main.cpp \
 HEADERS  += \
     AABB.hpp \
     Broadphase.hpp \
+    CellTable.hpp \
+    DynamicAABBTree.hpp \
+    HierarchicalHash.hpp \
+    LinearBVH.hpp \
     MainWindow.hpp \
+    PairManager.hpp \
+    PartitionedBroadphase.hpp \
+    Pool.hpp \
+    ProxyBatch.hpp \
     PruneSweep.hpp \
     Quadtree.hpp \
-    SpatialHash.hpp
+    RangeBatch.hpp \
+    SpatialHash.hpp \
+    ThreadPool.hpp \
+    Trace.hpp \
+    UniformGrid.hpp \
+    Workloads.hpp
 
 FORMS    +=
@@ -0,0 +1,135 @@
+/**
+ * @file CellTable.hpp
+ * @brief Implements an open addressing hash table from packed cell coordinates to cell slots.
+ * @section License
+ * Copyright (C) 2020 Robert Colton
+ * License pending. All rights reserved.
+ */
+
+#ifndef CELLTABLE_HPP
+#define CELLTABLE_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+/*
+ * Robin Hood hashing over a single flat slot array. Keys are two 32-bit cell coordinates packed into
+ * 64 bits and run through a full avalanche mixer, so neighbouring and negative cells spread evenly.
+ * Inserts displace entries that sit closer to their home slot than the incoming one, keeping probe
+ * sequences short and uniform, and erases shift the following run back instead of leaving tombstones.
+ * Values are plain 32-bit indices, leaving the cells themselves to live densely elsewhere.
+ */
+
+class CellTable {
+	struct Slot {
+		uint64_t key;
+		uint32_t value;
+		uint32_t distance; // one more than the probe distance, zero when empty
+	};
+
+	std::vector<Slot> slots;
+	size_t count = 0;
+	size_t mask = 0;
+
+	static uint64_t mix(uint64_t key) {
+		key ^= key >> 33;
+		key *= 0xFF51AFD7ED558CCDULL;
+		key ^= key >> 33;
+		key *= 0xC4CEB9FE1A85EC53ULL;
+		key ^= key >> 33;
+		return key;
+	}
+
+	void rehash(const size_t capacity) {
+		std::vector<Slot> old(capacity, Slot{0, 0, 0});
+		old.swap(slots);
+		mask = capacity - 1;
+		count = 0;
+		for (const auto& slot : old)
+			if (slot.distance) insert(slot.key, slot.value);
+	}
+
+public:
+	static const uint32_t npos = UINT32_MAX;
+
+	static uint64_t pack(const int x, const int y) {
+		return ((uint64_t) (uint32_t) x << 32) | (uint32_t) y;
+	}
+
+	static void unpack(const uint64_t key, int& x, int& y) {
+		x = (int) (uint32_t) (key >> 32);
+		y = (int) (uint32_t) key;
+	}
+
+	size_t size() const { return count; }
+	bool empty() const { return count == 0; }
+	size_t usedBytes() const { return count * sizeof(Slot); }
+	size_t reservedBytes() const { return slots.capacity() * sizeof(Slot); }
+
+	uint32_t find(const uint64_t key) const {
+		if (slots.empty()) return npos;
+		size_t i = mix(key) & mask;
+		for (uint32_t distance = 1;; ++distance, i = (i + 1) & mask) {
+			const Slot& slot = slots[i];
+			// an entry closer to home than we are means the key would have displaced it
+			if (slot.distance < distance) return npos;
+			if (slot.key == key) return slot.value;
+		}
+	}
+
+	// inserts the key if it is missing, returning the value now stored for it
+	uint32_t insert(uint64_t key, uint32_t value) {
+		if ((count + 1) * 8 > slots.size() * 7)
+			rehash(slots.empty() ? 16 : slots.size() * 2);
+
+		size_t i = mix(key) & mask;
+		uint32_t result = value;
+		for (uint32_t distance = 1;; ++distance, i = (i + 1) & mask) {
+			Slot& slot = slots[i];
+			if (!slot.distance) {
+				slot = Slot{key, value, distance};
+				++count;
+				return result;
+			}
+			if (slot.key == key) return slot.value;
+			if (slot.distance < distance) {
+				// rob the richer entry and carry it further along
+				std::swap(slot.key, key);
+				std::swap(slot.value, value);
+				std::swap(slot.distance, distance);
+			}
+		}
+	}
+
+	void assign(const uint64_t key, const uint32_t value) {
+		size_t i = mix(key) & mask;
+		while (slots[i].key != key || !slots[i].distance) i = (i + 1) & mask;
+		slots[i].value = value;
+	}
+
+	void erase(const uint64_t key) {
+		if (slots.empty()) return;
+		size_t i = mix(key) & mask;
+		for (uint32_t distance = 1;; ++distance, i = (i + 1) & mask) {
+			if (slots[i].distance < distance) return;
+			if (slots[i].key == key) break;
+		}
+		// shift the rest of the run back one slot
+		for (size_t next = (i + 1) & mask; slots[next].distance > 1; i = next, next = (next + 1) & mask) {
+			slots[i] = slots[next];
+			--slots[i].distance;
+		}
+		slots[i].distance = 0;
+		--count;
+	}
+
+	void clear() {
+		for (auto& slot : slots)
+			slot.distance = 0;
+		count = 0;
+	}
+};
+
+#endif // CELLTABLE_HPP
@@ -0,0 +1,480 @@
+/**
+ * @file DynamicAABBTree.hpp
+ * @brief Implements a class for dynamic bounding volume hierarchy collision detection.
+ * @section License
+ * Copyright (C) 2020 Robert Colton
+ * License pending. All rights reserved.
+ */
+
+#ifndef DYNAMICAABBTREE_HPP
+#define DYNAMICAABBTREE_HPP
+
+#include "Broadphase.hpp"
+
+#include <algorithm>
+#include <cstdlib>
+#include <vector>
+
+/*
+ * Dynamic AABB Tree
+ *
+ * Leaves hold proxies under a "fat" AABB that is enlarged by a margin and by the predicted motion,
+ * capped at a few margins, so an update only touches the tree once a proxy escapes its fat box.
+ * Leaves are inserted next to the sibling that minimizes the growth in perimeter and every ancestor
+ * is rebalanced with AVL style rotations on the way back up, keeping the height logarithmic. Nothing about the tree depends on
+ * world bounds or a cell size, so unbounded worlds with mixed object sizes are handled the same.
+ *
+ */
+
+class DynamicAABBTree : public Broadphase {
+	static const int nullNode = -1;
+
+	struct Node {
+		AABB aabb;
+		Proxy* proxy;
+		int parent; // next free node while on the free list
+		int child1, child2;
+		int height; // leaves are 0, free nodes -1
+
+		bool isLeaf() const { return child1 == nullNode; }
+	};
+
+	// a traversal stack that lives on the call stack until a degenerate tree outgrows it
+	template<typename T>
+	class Stack {
+		T local[64];
+		T* items = local;
+		size_t capacity = 64, top = 0;
+		std::vector<T> heap;
+
+	public:
+		Stack() = default;
+		Stack(const Stack&) = delete;
+		Stack& operator=(const Stack&) = delete;
+
+		bool empty() const { return top == 0; }
+		T pop() { return items[--top]; }
+		void push(const T& item) {
+			if (top == capacity) {
+				if (heap.empty()) heap.assign(local, local + top);
+				capacity *= 2;
+				heap.resize(capacity);
+				items = heap.data();
+			}
+			items[top++] = item;
+		}
+	};
+
+	struct NodePair {
+		int a, b; // a == b stands for the pairs within one subtree
+	};
+
+	std::vector<Node> nodes;
+	int root, freeList;
+	int margin;
+
+	static AABB combine(const AABB& a, const AABB& b) {
+		const int x = std::min(a.getX(), b.getX()),
+							y = std::min(a.getY(), b.getY()),
+							right = std::max(a.getX() + a.getWidth(), b.getX() + b.getWidth()),
+							bottom = std::max(a.getY() + a.getHeight(), b.getY() + b.getHeight());
+		return AABB(x, y, right - x, bottom - y);
+	}
+
+	static long long perimeter(const AABB& aabb) {
+		return 2LL * ((long long) aabb.getWidth() + aabb.getHeight());
+	}
+
+	static bool encloses(const AABB& outer, const AABB& inner) {
+		return outer.getX() <= inner.getX() && outer.getY() <= inner.getY() &&
+				inner.getX() + inner.getWidth() <= outer.getX() + outer.getWidth() &&
+				inner.getY() + inner.getHeight() <= outer.getY() + outer.getHeight();
+	}
+
+	AABB fatten(const AABB& aabb, const int dx = 0, const int dy = 0) const {
+		AABB fat(aabb.getX() - margin, aabb.getY() - margin,
+						 aabb.getWidth() + 2 * margin, aabb.getHeight() + 2 * margin);
+		// stretch the box ahead of the motion so a steady mover is not reinserted every frame, but
+		// only by a few margins so a teleport does not leave a huge leaf that later moves never refit
+		const int sx = 2 * std::max(-2 * margin, std::min(2 * margin, dx));
+		const int sy = 2 * std::max(-2 * margin, std::min(2 * margin, dy));
+		if (sx < 0) fat.setX(fat.getX() + sx);
+		if (sy < 0) fat.setY(fat.getY() + sy);
+		fat.setSize(fat.getWidth() + std::abs(sx), fat.getHeight() + std::abs(sy));
+		return fat;
+	}
+
+	int allocateNode() {
+		int node = freeList;
+		if (node == nullNode) {
+			node = (int) nodes.size();
+			nodes.push_back(Node());
+		} else {
+			freeList = nodes[node].parent;
+		}
+		Node& n = nodes[node];
+		n.proxy = nullptr;
+		n.parent = n.child1 = n.child2 = nullNode;
+		n.height = 0;
+		return node;
+	}
+
+	void freeNode(const int node) {
+		nodes[node].parent = freeList;
+		nodes[node].height = -1;
+		freeList = node;
+	}
+
+	int balance(const int iA) {
+		Node& A = nodes[iA];
+		if (A.isLeaf() || A.height < 2) return iA;
+
+		const int iB = A.child1, iC = A.child2;
+		Node &B = nodes[iB], &C = nodes[iC];
+		const int balance = C.height - B.height;
+
+		// rotate C up
+		if (balance > 1) {
+			const int iF = C.child1, iG = C.child2;
+			Node &F = nodes[iF], &G = nodes[iG];
+
+			C.child1 = iA;
+			C.parent = A.parent;
+			A.parent = iC;
+			replaceChild(C.parent, iA, iC);
+
+			if (F.height > G.height) {
+				C.child2 = iF;
+				A.child2 = iG;
+				G.parent = iA;
+				A.aabb = combine(B.aabb, G.aabb);
+				C.aabb = combine(A.aabb, F.aabb);
+				A.height = 1 + std::max(B.height, G.height);
+				C.height = 1 + std::max(A.height, F.height);
+			} else {
+				C.child2 = iG;
+				A.child2 = iF;
+				F.parent = iA;
+				A.aabb = combine(B.aabb, F.aabb);
+				C.aabb = combine(A.aabb, G.aabb);
+				A.height = 1 + std::max(B.height, F.height);
+				C.height = 1 + std::max(A.height, G.height);
+			}
+			return iC;
+		}
+
+		// rotate B up
+		if (balance < -1) {
+			const int iD = B.child1, iE = B.child2;
+			Node &D = nodes[iD], &E = nodes[iE];
+
+			B.child1 = iA;
+			B.parent = A.parent;
+			A.parent = iB;
+			replaceChild(B.parent, iA, iB);
+
+			if (D.height > E.height) {
+				B.child2 = iD;
+				A.child1 = iE;
+				E.parent = iA;
+				A.aabb = combine(C.aabb, E.aabb);
+				B.aabb = combine(A.aabb, D.aabb);
+				A.height = 1 + std::max(C.height, E.height);
+				B.height = 1 + std::max(A.height, D.height);
+			} else {
+				B.child2 = iE;
+				A.child1 = iD;
+				D.parent = iA;
+				A.aabb = combine(C.aabb, D.aabb);
+				B.aabb = combine(A.aabb, E.aabb);
+				A.height = 1 + std::max(C.height, D.height);
+				B.height = 1 + std::max(A.height, E.height);
+			}
+			return iB;
+		}
+
+		return iA;
+	}
+
+	void replaceChild(const int parent, const int oldChild, const int newChild) {
+		if (parent == nullNode) {
+			root = newChild;
+			return;
+		}
+		if (nodes[parent].child1 == oldChild) nodes[parent].child1 = newChild;
+		else nodes[parent].child2 = newChild;
+	}
+
+	void refit(int index) {
+		while (index != nullNode) {
+			index = balance(index);
+			Node& node = nodes[index];
+			const Node &child1 = nodes[node.child1], &child2 = nodes[node.child2];
+			node.height = 1 + std::max(child1.height, child2.height);
+			node.aabb = combine(child1.aabb, child2.aabb);
+			index = node.parent;
+		}
+	}
+
+	void insertLeaf(const int leaf) {
+		if (root == nullNode) {
+			root = leaf;
+			nodes[root].parent = nullNode;
+			return;
+		}
+
+		// find the cheapest sibling by perimeter growth
+		const AABB leafAABB = nodes[leaf].aabb;
+		int index = root;
+		while (!nodes[index].isLeaf()) {
+			const Node& node = nodes[index];
+			const long long area = perimeter(node.aabb),
+					combinedArea = perimeter(combine(node.aabb, leafAABB)),
+					cost = 2 * combinedArea,
+					inheritanceCost = 2 * (combinedArea - area);
+
+			long long childCost[2];
+			const int children[2] = { node.child1, node.child2 };
+			for (int i = 0; i < 2; ++i) {
+				const Node& child = nodes[children[i]];
+				const long long grown = perimeter(combine(leafAABB, child.aabb));
+				childCost[i] = (child.isLeaf() ? grown : grown - perimeter(child.aabb)) + inheritanceCost;
+			}
+
+			if (cost < childCost[0] && cost < childCost[1]) break;
+			index = childCost[0] < childCost[1] ? children[0] : children[1];
+		}
+
+		const int sibling = index;
+		const int oldParent = nodes[sibling].parent;
+		const int newParent = allocateNode();
+		Node& parent = nodes[newParent];
+		parent.parent = oldParent;
+		parent.aabb = combine(leafAABB, nodes[sibling].aabb);
+		parent.height = nodes[sibling].height + 1;
+		parent.child1 = sibling;
+		parent.child2 = leaf;
+		replaceChild(oldParent, sibling, newParent);
+		nodes[sibling].parent = newParent;
+		nodes[leaf].parent = newParent;
+
+		refit(nodes[leaf].parent);
+	}
+
+	void removeLeaf(const int leaf) {
+		if (leaf == root) {
+			root = nullNode;
+			return;
+		}
+
+		const int parent = nodes[leaf].parent,
+							grandParent = nodes[parent].parent,
+							sibling = nodes[parent].child1 == leaf ?
+									nodes[parent].child2 : nodes[parent].child1;
+
+		replaceChild(grandParent, parent, sibling);
+		nodes[sibling].parent = grandParent;
+		freeNode(parent);
+		refit(grandParent);
+	}
+
+	void queryStructure(const int index, const int depth, StructureCallback callback, void* context) const {
+		const Node& node = nodes[index];
+		callback(node.aabb, node.isLeaf() ? 1 : 0, depth, context);
+		if (node.isLeaf()) return;
+		queryStructure(node.child1, depth + 1, callback, context);
+		queryStructure(node.child2, depth + 1, callback, context);
+	}
+
+public:
+	DynamicAABBTree(int margin = 8):
+		Broadphase(), root(nullNode), freeList(nullNode), margin(margin) {}
+	~DynamicAABBTree() { clear(); }
+
+	int getMargin() const { return margin; }
+	void setMargin(const int margin) { this->margin = margin; }
+
+	int getHeight() const {
+		return root == nullNode ? 0 : nodes[root].height;
+	}
+
+	using Broadphase::addProxy;
+
+protected:
+	Proxy* addProxy(Proxy* proxy) override {
+		const int leaf = allocateNode();
+		nodes[leaf].aabb = fatten(proxy->aabb);
+		nodes[leaf].proxy = proxy;
+		proxy->index = leaf;
+		insertLeaf(leaf);
+		return proxy;
+	}
+
+public:
+	void removeProxy(Proxy* proxy, bool free = true) override {
+		const int leaf = proxy->index;
+		removeLeaf(leaf);
+		freeNode(leaf);
+		proxy->index = -1;
+		if (free) destroyProxy(proxy);
+	}
+
+	void updateProxy(Proxy* proxy, const AABB& aabb) override {
+		const int leaf = proxy->index;
+		const int dx = aabb.getX() - proxy->aabb.getX(),
+							dy = aabb.getY() - proxy->aabb.getY();
+		proxy->aabb = aabb;
+		if (encloses(nodes[leaf].aabb, aabb)) return;
+
+		removeLeaf(leaf);
+		nodes[leaf].aabb = fatten(aabb, dx, dy);
+		insertLeaf(leaf);
+	}
+
+	using Broadphase::queryRange;
+
+	template<typename Visitor>
+	bool visitRange(const int x, const int y, const int radius, Visitor&& visit) const {
+		BROADPHASE_STATS_SCOPE();
+		if (root == nullNode) return true;
+
+		Stack<int> stack;
+		stack.push(root);
+		while (!stack.empty()) {
+			const Node& node = nodes[stack.pop()];
+			BROADPHASE_COUNT(nodes, 1);
+			BROADPHASE_COUNT(tests, 1);
+			if (!node.aabb.intersectsCircle(x, y, radius)) continue;
+			if (node.isLeaf()) {
+				BROADPHASE_COUNT(tests, 1);
+				BROADPHASE_OCCUPANCY(1);
+				if (!node.proxy->aabb.intersectsCircle(x, y, radius)) continue;
+				BROADPHASE_COUNT(hits, 1);
+				if (!visit(node.proxy)) return false;
+			} else {
+				stack.push(node.child1);
+				stack.push(node.child2);
+			}
+		}
+		return true;
+	}
+
+	void queryRange(const int x, const int y, const int radius, std::vector<Proxy*>& hits) const override {
+		visitRange(x, y, radius, [&](Proxy* proxy) { hits.push_back(proxy); return true; });
+	}
+
+	bool queryRange(const int x, const int y, const int radius, QueryCallback callback, void* context) const override {
+		return visitRange(x, y, radius, [=](Proxy* proxy) { return callback(proxy, context); });
+	}
+
+	using Broadphase::queryAABB;
+
+	template<typename Visitor>
+	bool visitAABB(const AABB& aabb, Visitor&& visit) const {
+		BROADPHASE_STATS_SCOPE();
+		if (root == nullNode) return true;
+
+		Stack<int> stack;
+		stack.push(root);
+		while (!stack.empty()) {
+			const Node& node = nodes[stack.pop()];
+			BROADPHASE_COUNT(nodes, 1);
+			BROADPHASE_COUNT(tests, 1);
+			if (!node.aabb.intersectsAABB(aabb)) continue;
+			if (node.isLeaf()) {
+				BROADPHASE_COUNT(tests, 1);
+				BROADPHASE_OCCUPANCY(1);
+				if (!node.proxy->aabb.intersectsAABB(aabb)) continue;
+				BROADPHASE_COUNT(hits, 1);
+				if (!visit(node.proxy)) return false;
+			} else {
+				stack.push(node.child1);
+				stack.push(node.child2);
+			}
+		}
+		return true;
+	}
+
+	void queryAABB(const AABB& aabb, std::vector<Proxy*>& hits) const override {
+		visitAABB(aabb, [&](Proxy* proxy) { hits.push_back(proxy); return true; });
+	}
+
+	bool queryAABB(const AABB& aabb, QueryCallback callback, void* context) const override {
+		return visitAABB(aabb, [=](Proxy* proxy) { return callback(proxy, context); });
+	}
+
+	using Broadphase::queryCollisionPairs;
+
+	/**
+	 * Descends the tree against itself: a subtree yields the pairs within each child and then the pairs
+	 * across the two children, and two subtrees are only opened while their boxes overlap, always
+	 * splitting the taller one. Every pair of leaves meets in exactly one place, so each overlapping
+	 * pair is reported once without one full query per leaf.
+	 */
+	template<typename Visitor>
+	bool visitPairs(Visitor&& visit) const {
+		BROADPHASE_STATS_SCOPE();
+		if (root == nullNode) return true;
+
+		Stack<NodePair> stack;
+		stack.push({root, root});
+		while (!stack.empty()) {
+			const NodePair pair = stack.pop();
+			const Node &a = nodes[pair.a], &b = nodes[pair.b];
+			BROADPHASE_COUNT(nodes, 1);
+			if (pair.a == pair.b) {
+				if (a.isLeaf()) continue;
+				stack.push({a.child1, a.child2});
+				stack.push({a.child2, a.child2});
+				stack.push({a.child1, a.child1});
+				continue;
+			}
+			BROADPHASE_COUNT(tests, 1);
+			if (!a.aabb.intersectsAABB(b.aabb)) continue;
+			if (a.isLeaf() && b.isLeaf()) {
+				BROADPHASE_OCCUPANCY(1);
+				BROADPHASE_COUNT(tests, 1);
+				if (!a.proxy->aabb.intersectsAABB(b.proxy->aabb)) continue;
+				BROADPHASE_COUNT(hits, 1);
+				if (!visit(a.proxy, b.proxy)) return false;
+			} else if (b.isLeaf() || (!a.isLeaf() && a.height >= b.height)) {
+				stack.push({a.child1, pair.b});
+				stack.push({a.child2, pair.b});
+			} else {
+				stack.push({pair.a, b.child1});
+				stack.push({pair.a, b.child2});
+			}
+		}
+		return true;
+	}
+
+	void queryCollisionPairs(std::vector<ProxyPair>& pairs) const override {
+		visitPairs([&](Proxy* a, Proxy* b) { pairs.emplace_back(a, b); return true; });
+	}
+
+	bool queryCollisionPairs(PairCallback callback, void* context) const override {
+		return visitPairs([=](Proxy* a, Proxy* b) { return callback(a, b, context); });
+	}
+
+	// every node's fattened box, leaves holding their one proxy
+	void queryStructure(StructureCallback callback, void* context) const override {
+		if (root != nullNode) queryStructure(root, 0, callback, context);
+	}
+
+#ifdef BROADPHASE_STATS
+	void measureMemory(size_t& used, size_t& reserved) const override {
+		Broadphase::measureMemory(used, reserved);
+		for (const auto& node : nodes)
+			if (node.height >= 0) used += sizeof(Node);
+		reserved += nodes.capacity() * sizeof(Node);
+	}
+#endif
+
+	void clear() override {
+		nodes.clear();
+		releaseProxies();
+		root = freeList = nullNode;
+	}
+};
+
+#endif // DYNAMICAABBTREE_HPP
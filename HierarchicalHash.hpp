@@ -0,0 +1,217 @@
+/**
+ * @file HierarchicalHash.hpp
+ * @brief Implements a multi-resolution spatial hash with a level per power of two cell size.
+ * @section License
+ * Copyright (C) 2020 Robert Colton
+ * License pending. All rights reserved.
+ */
+
+#ifndef HIERARCHICALHASH_HPP
+#define HIERARCHICALHASH_HPP
+
+#include "Broadphase.hpp"
+#include "SpatialHash.hpp"
+
+#include <algorithm>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+/*
+ * Hierarchical Hashing
+ *
+ * One spatial hash per level, the cells doubling in size from one level to the next. A proxy goes
+ * into the first level whose cells are at least as large as its longer side, so it covers at most
+ * two by two cells there, and only proxies too big for the coarsest level span more. Tiny and huge
+ * proxies then each sit in cells matching their size instead of one cell size being wrong for one
+ * of them. Queries visit every level holding proxies, each with the range of its own cells.
+ *
+ * The proxies belong to this broadphase and are only linked into the level hashes, which take over
+ * their index while they hold them. Pairs within a level come from that level's hash. A pair across
+ * levels is found by the smaller proxy querying each coarser level with its box, so each pair is
+ * reported exactly once.
+ */
+
+class HierarchicalHash : public Broadphase {
+	struct Slot {
+		int level = -1; // -1 while the id is not held here
+		uint32_t member = 0; // position in the member list
+	};
+
+	int cellSize;
+	std::vector<std::unique_ptr<SpatialHash>> levels;
+	std::vector<size_t> counts; // proxies per level
+	std::vector<Slot> slots; // indexed by proxy id
+	std::vector<Proxy*> members;
+
+	int levelFor(const AABB& aabb) const {
+		const int size = std::max(aabb.getWidth(), aabb.getHeight());
+		int level = 0;
+		while (level + 1 < (int) levels.size() && (cellSize << level) < size) ++level;
+		return level;
+	}
+
+	void insert(Proxy* proxy, const int level) {
+		levels[level]->linkProxy(proxy);
+		++counts[level];
+		slots[proxy->id].level = level;
+	}
+
+	void erase(Proxy* proxy) {
+		const int level = slots[proxy->id].level;
+		levels[level]->unlinkProxy(proxy);
+		--counts[level];
+	}
+
+public:
+	/**
+	 * The finest level has cells of cellSize and each of the levelCount levels doubles it, so the
+	 * defaults start at the plain hash's 64 and cover proxies up to 2048 in at most four cells.
+	 */
+	HierarchicalHash(int cellSize = 64, int levelCount = 6):
+		Broadphase(), cellSize(std::max(1, cellSize)), counts(std::max(1, levelCount), 0) {
+		for (size_t level = 0; level < counts.size(); ++level) {
+			const int size = this->cellSize << level;
+			levels.emplace_back(new SpatialHash(size, size));
+		}
+	}
+	~HierarchicalHash() { clear(); }
+
+	int getCellSize() const { return cellSize; }
+	int getLevelCount() const { return (int) levels.size(); }
+	const SpatialHash& getLevel(const int level) const { return *levels[level]; }
+	size_t getLevelProxyCount(const int level) const { return counts[level]; }
+
+	// the level holding the proxy, or -1 if it is not in this hash
+	int getProxyLevel(const Proxy* proxy) const {
+		return proxy->id < slots.size() ? slots[proxy->id].level : -1;
+	}
+
+	using Broadphase::addProxy;
+
+protected:
+	Proxy* addProxy(Proxy* proxy) override {
+		if (slots.size() <= proxy->id) slots.resize(proxy->id + 1);
+		slots[proxy->id].member = (uint32_t) members.size();
+		members.push_back(proxy);
+		insert(proxy, levelFor(proxy->aabb));
+		return proxy;
+	}
+
+public:
+	void removeProxy(Proxy* proxy, bool free = true) override {
+		erase(proxy);
+		const uint32_t member = slots[proxy->id].member;
+		Proxy* last = members.back();
+		members[member] = last;
+		slots[last->id].member = member;
+		members.pop_back();
+		slots[proxy->id] = Slot();
+		if (free) destroyProxy(proxy);
+	}
+
+	// moves within a level are incremental, only a change of size can move a proxy between levels
+	void updateProxy(Proxy* proxy, const AABB& aabb) override {
+		const int level = levelFor(aabb);
+		if (level == slots[proxy->id].level) {
+			levels[level]->updateProxy(proxy, aabb);
+			return;
+		}
+		erase(proxy);
+		proxy->aabb = aabb;
+		insert(proxy, level);
+	}
+
+	// every level's occupied cells, the level as their depth
+	void queryStructure(StructureCallback callback, void* context) const override {
+		for (int level = 0; level < (int) levels.size(); ++level)
+			levels[level]->visitStructure([&](const AABB& bounds, size_t count, int) {
+				callback(bounds, count, level, context);
+			});
+	}
+
+#ifdef BROADPHASE_STATS
+	void measureMemory(size_t& used, size_t& reserved) const override {
+		Broadphase::measureMemory(used, reserved);
+		for (const auto& level : levels)
+			level->measureMemory(used, reserved);
+		used += members.size() * sizeof(Proxy*) + slots.size() * sizeof(Slot);
+		reserved += members.capacity() * sizeof(Proxy*) + slots.capacity() * sizeof(Slot) +
+								levels.capacity() * sizeof(levels[0]) + counts.capacity() * sizeof(size_t);
+	}
+#endif
+
+	void clear() override {
+		for (auto& level : levels)
+			level->clear();
+		std::fill(counts.begin(), counts.end(), 0);
+		slots.clear();
+		members.clear();
+		releaseProxies();
+	}
+
+	using Broadphase::queryRange;
+
+	template<typename Visitor>
+	bool visitRange(const int x, const int y, const int radius, Visitor&& visit) const {
+		BROADPHASE_STATS_SCOPE();
+		for (size_t level = 0; level < levels.size(); ++level)
+			if (counts[level] && !levels[level]->visitRange(x, y, radius, visit)) return false;
+		return true;
+	}
+
+	void queryRange(const int x, const int y, const int radius, std::vector<Proxy*>& hits) const override {
+		visitRange(x, y, radius, [&](Proxy* proxy) { hits.push_back(proxy); return true; });
+	}
+
+	bool queryRange(const int x, const int y, const int radius, QueryCallback callback, void* context) const override {
+		return visitRange(x, y, radius, [=](Proxy* proxy) { return callback(proxy, context); });
+	}
+
+	using Broadphase::queryAABB;
+
+	template<typename Visitor>
+	bool visitAABB(const AABB& aabb, Visitor&& visit) const {
+		BROADPHASE_STATS_SCOPE();
+		for (size_t level = 0; level < levels.size(); ++level)
+			if (counts[level] && !levels[level]->visitAABB(aabb, visit)) return false;
+		return true;
+	}
+
+	void queryAABB(const AABB& aabb, std::vector<Proxy*>& hits) const override {
+		visitAABB(aabb, [&](Proxy* proxy) { hits.push_back(proxy); return true; });
+	}
+
+	bool queryAABB(const AABB& aabb, QueryCallback callback, void* context) const override {
+		return visitAABB(aabb, [=](Proxy* proxy) { return callback(proxy, context); });
+	}
+
+	using Broadphase::queryCollisionPairs;
+
+	template<typename Visitor>
+	bool visitPairs(Visitor&& visit) const {
+		BROADPHASE_STATS_SCOPE();
+		for (size_t level = 0; level < levels.size(); ++level)
+			if (counts[level] > 1 && !levels[level]->visitPairs(visit)) return false;
+		for (auto proxy : members) {
+			for (size_t level = slots[proxy->id].level + 1; level < levels.size(); ++level) {
+				if (!counts[level]) continue;
+				const bool more = levels[level]->visitAABB(proxy->aabb, [&](Proxy* other) {
+					return visit(proxy, other);
+				});
+				if (!more) return false;
+			}
+		}
+		return true;
+	}
+
+	void queryCollisionPairs(std::vector<ProxyPair>& pairs) const override {
+		visitPairs([&](Proxy* a, Proxy* b) { pairs.emplace_back(a, b); return true; });
+	}
+
+	bool queryCollisionPairs(PairCallback callback, void* context) const override {
+		return visitPairs([=](Proxy* a, Proxy* b) { return callback(a, b, context); });
+	}
+};
+
+#endif // HIERARCHICALHASH_HPP
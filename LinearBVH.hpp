@@ -0,0 +1,424 @@
+/**
+ * @file LinearBVH.hpp
+ * @brief Implements a Morton ordered bounding volume hierarchy rebuilt from scratch by radix sort.
+ * @section License
+ * Copyright (C) 2020 Robert Colton
+ * License pending. All rights reserved.
+ */
+
+#ifndef LINEARBVH_HPP
+#define LINEARBVH_HPP
+
+#include "Broadphase.hpp"
+#include "ProxyBatch.hpp"
+#include "ThreadPool.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <climits>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+/*
+ * Linear Construction
+ *
+ * Like the uniform grid, changes only mark the hierarchy stale and it is rebuilt from scratch by
+ * the next query or an explicit rebuild(). The centers of the proxies are quantized to 16 bits per
+ * axis and interleaved into 32-bit Morton codes, then four 8-bit LSD radix passes sort the proxies
+ * along the Z-order curve, so proxies close in space end up close in memory. The sorted run is cut
+ * into leaves of leafSize proxies, and a complete binary tree over the leaves is stored implicitly
+ * in heap order and bounded level by level from the bottom. Every step is a linear pass that can
+ * be split over a thread pool, with each worker sorting its slice of the keys through its own
+ * histogram.
+ *
+ * The tree is not balanced by area like the dynamic AABB tree, but it needs no pointers and no
+ * incremental upkeep, which pays off when most proxies move every frame.
+ */
+
+class LinearBVH : public Broadphase {
+	struct Bounds {
+		int minX, minY, maxX, maxY;
+
+		bool empty() const { return minX > maxX; }
+
+		bool intersects(const int x0, const int y0, const int x1, const int y1) const {
+			return x0 <= maxX && x1 >= minX && y0 <= maxY && y1 >= minY;
+		}
+
+		bool intersectsCircle(const int x, const int y, const int radius) const {
+			if (empty()) return false;
+			const long long dx = x - std::max(minX, std::min(x, maxX)),
+											dy = y - std::max(minY, std::min(y, maxY));
+			return dx * dx + dy * dy <= (long long) radius * radius;
+		}
+
+		void add(const Bounds& other) {
+			minX = std::min(minX, other.minX);
+			minY = std::min(minY, other.minY);
+			maxX = std::max(maxX, other.maxX);
+			maxY = std::max(maxY, other.maxY);
+		}
+	};
+
+	enum { grain = 4096 }; // fewer items than this are not worth waking the pool for
+
+	int leafSize;
+	// indexed by each proxy's index
+	std::vector<Proxy*> members;
+
+	// the hierarchy, rebuilt by whichever query first finds it stale
+	mutable std::atomic<bool> stale;
+	mutable std::mutex buildMutex;
+	mutable std::vector<uint32_t> keys, values, sortedKeys, sortedValues;
+	mutable std::vector<uint32_t> histograms; // 256 digit counts per worker
+	mutable std::vector<Bounds> workerBounds;
+	mutable ProxyBatch entries; // in Morton order
+	mutable std::vector<Bounds> nodes; // heap order, the leaves starting at leafBase
+	mutable size_t leafBase = 0;
+
+	static Bounds emptyBounds() {
+		return Bounds{ INT_MAX, INT_MAX, INT_MIN, INT_MIN };
+	}
+
+	// spreads the low 16 bits out to the even bits
+	static uint32_t spread(uint32_t v) {
+		v &= 0xFFFF;
+		v = (v | (v << 8)) & 0x00FF00FF;
+		v = (v | (v << 4)) & 0x0F0F0F0F;
+		v = (v | (v << 2)) & 0x33333333;
+		v = (v | (v << 1)) & 0x55555555;
+		return v;
+	}
+
+	// twice the center, so odd sizes keep their half pixel
+	static long long centerX(const AABB& aabb) { return 2LL * aabb.getX() + aabb.getWidth(); }
+	static long long centerY(const AABB& aabb) { return 2LL * aabb.getY() + aabb.getHeight(); }
+
+	template<typename Task>
+	static void forEachSlice(ThreadPool* threads, const size_t count, Task&& task) {
+		if (!threads || count < grain) task(0, 0, count);
+		else threads->forEachRange(count, task);
+	}
+
+	void radixSort(ThreadPool* threads, const unsigned workers) const {
+		const size_t count = keys.size();
+		sortedKeys.resize(count);
+		sortedValues.resize(count);
+		for (int shift = 0; shift < 32; shift += 8) {
+			histograms.assign(workers * 256, 0);
+			forEachSlice(threads, count, [&](const unsigned worker, const size_t begin, const size_t end) {
+				uint32_t* counts = &histograms[worker * 256];
+				for (size_t i = begin; i < end; ++i)
+					++counts[(keys[i] >> shift) & 0xFF];
+			});
+			// every key sharing this byte leaves the order as it is
+			size_t same = 0;
+			for (unsigned worker = 0; worker < workers; ++worker)
+				same += histograms[worker * 256 + ((keys[0] >> shift) & 0xFF)];
+			if (same == count) continue;
+
+			uint32_t total = 0;
+			for (size_t digit = 0; digit < 256; ++digit) {
+				for (unsigned worker = 0; worker < workers; ++worker) {
+					uint32_t& slot = histograms[worker * 256 + digit];
+					const uint32_t cursor = total;
+					total += slot;
+					slot = cursor;
+				}
+			}
+			forEachSlice(threads, count, [&](const unsigned worker, const size_t begin, const size_t end) {
+				uint32_t* cursors = &histograms[worker * 256];
+				for (size_t i = begin; i < end; ++i) {
+					const uint32_t slot = cursors[(keys[i] >> shift) & 0xFF]++;
+					sortedKeys[slot] = keys[i];
+					sortedValues[slot] = values[i];
+				}
+			});
+			keys.swap(sortedKeys);
+			values.swap(sortedValues);
+		}
+	}
+
+	void build(ThreadPool* threads) const {
+		const size_t count = members.size();
+		const unsigned workers = threads ? threads->size() : 1;
+		entries.resize(count);
+		if (!count) {
+			nodes.clear();
+			leafBase = 0;
+			stale.store(false, std::memory_order_release);
+			return;
+		}
+
+		// the bounds of every center, which the codes are quantized to
+		workerBounds.assign(workers, emptyBounds());
+		forEachSlice(threads, count, [&](const unsigned worker, const size_t begin, const size_t end) {
+			long long x0 = LLONG_MAX, y0 = LLONG_MAX, x1 = LLONG_MIN, y1 = LLONG_MIN;
+			for (size_t i = begin; i < end; ++i) {
+				const AABB& aabb = members[i]->aabb;
+				x0 = std::min(x0, centerX(aabb));
+				y0 = std::min(y0, centerY(aabb));
+				x1 = std::max(x1, centerX(aabb));
+				y1 = std::max(y1, centerY(aabb));
+			}
+			// halved back into int range, which costs the codes nothing at 16 bits an axis
+			if (begin < end) workerBounds[worker] = Bounds{ (int) (x0 >> 1), (int) (y0 >> 1), (int) (x1 >> 1), (int) (y1 >> 1) };
+		});
+		Bounds centers = emptyBounds();
+		for (const auto& bounds : workerBounds)
+			if (!bounds.empty()) centers.add(bounds);
+		const long long spanX = std::max(1LL, (long long) centers.maxX - centers.minX + 1),
+										spanY = std::max(1LL, (long long) centers.maxY - centers.minY + 1);
+
+		keys.resize(count);
+		values.resize(count);
+		forEachSlice(threads, count, [&](unsigned, const size_t begin, const size_t end) {
+			for (size_t i = begin; i < end; ++i) {
+				const AABB& aabb = members[i]->aabb;
+				const long long x = std::min(spanX - 1, (centerX(aabb) >> 1) - centers.minX),
+												y = std::min(spanY - 1, (centerY(aabb) >> 1) - centers.minY);
+				keys[i] = spread((uint32_t) (x * 65536 / spanX)) | (spread((uint32_t) (y * 65536 / spanY)) << 1);
+				values[i] = (uint32_t) i;
+			}
+		});
+		radixSort(threads, workers);
+
+		const size_t leaves = (count + leafSize - 1) / leafSize;
+		size_t width = 1;
+		while (width < leaves) width *= 2;
+		leafBase = width - 1;
+		nodes.resize(2 * width - 1);
+		forEachSlice(threads, width, [&](unsigned, const size_t begin, const size_t end) {
+			const int* minX = entries.minX();
+			const int* minY = entries.minY();
+			const int* maxX = entries.maxX();
+			const int* maxY = entries.maxY();
+			for (size_t leaf = begin; leaf < end; ++leaf) {
+				Bounds bounds = emptyBounds();
+				for (size_t i = leaf * leafSize; i < std::min(count, (leaf + 1) * leafSize); ++i) {
+					entries.set(i, members[values[i]]);
+					bounds.add(Bounds{ minX[i], minY[i], maxX[i], maxY[i] });
+				}
+				nodes[leafBase + leaf] = bounds;
+			}
+		});
+		// each level up bounds its two children, the wide levels near the leaves split over the pool
+		for (size_t first = leafBase; first > 0; first = (first - 1) / 2) {
+			const size_t parents = (first + 1) / 2, base = parents - 1;
+			forEachSlice(threads, parents, [&](unsigned, const size_t begin, const size_t end) {
+				for (size_t i = base + begin; i < base + end; ++i) {
+					nodes[i] = nodes[2 * i + 1];
+					nodes[i].add(nodes[2 * i + 2]);
+				}
+			});
+		}
+		stale.store(false, std::memory_order_release);
+	}
+
+	// rebuilds on this thread if anything changed since the last build
+	void update() const {
+		if (!stale.load(std::memory_order_acquire)) return;
+		std::lock_guard<std::mutex> lock(buildMutex);
+		if (stale.load(std::memory_order_relaxed)) build(nullptr);
+	}
+
+	// the entries of a leaf node
+	size_t leafBegin(const size_t node) const { return std::min(entries.size(), (node - leafBase) * leafSize); }
+	size_t leafEnd(const size_t node) const { return std::min(entries.size(), (node - leafBase + 1) * leafSize); }
+
+	/**
+	 * Walks the nodes passing test and hands the entries of each leaf reached to filter, which
+	 * returns false to stop.
+	 */
+	template<typename Test, typename Filter>
+	bool traverse(Test&& test, Filter&& filter) const {
+		update();
+		if (nodes.empty()) return true;
+		size_t stack[64];
+		int top = 0;
+		stack[top++] = 0;
+		while (top) {
+			const size_t index = stack[--top];
+			BROADPHASE_COUNT(nodes, 1);
+			BROADPHASE_COUNT(tests, 1);
+			if (!test(nodes[index])) continue;
+			if (index >= leafBase) {
+				BROADPHASE_OCCUPANCY(leafEnd(index) - leafBegin(index));
+				if (!filter(index)) return false;
+			} else {
+				stack[top++] = 2 * index + 2;
+				stack[top++] = 2 * index + 1;
+			}
+		}
+		return true;
+	}
+
+	void queryStructure(const size_t index, const int depth, StructureCallback callback, void* context) const {
+		const Bounds& bounds = nodes[index];
+		if (bounds.empty()) return;
+		const bool leaf = index >= leafBase;
+		callback(AABB(bounds.minX, bounds.minY, bounds.maxX - bounds.minX, bounds.maxY - bounds.minY),
+						 leaf ? leafEnd(index) - leafBegin(index) : 0, depth, context);
+		if (leaf) return;
+		queryStructure(2 * index + 1, depth + 1, callback, context);
+		queryStructure(2 * index + 2, depth + 1, callback, context);
+	}
+
+public:
+	explicit LinearBVH(int leafSize = 8):
+		Broadphase(), leafSize(std::max(1, leafSize)), stale(false) {}
+	~LinearBVH() { clear(); }
+
+	int getLeafSize() const { return leafSize; }
+
+	using Broadphase::addProxy;
+
+protected:
+	Proxy* addProxy(Proxy* proxy) override {
+		proxy->index = (int) members.size();
+		members.push_back(proxy);
+		stale.store(true, std::memory_order_relaxed);
+		return proxy;
+	}
+
+public:
+	void removeProxy(Proxy* proxy, bool free = true) override {
+		Proxy* last = members.back();
+		members[proxy->index] = last;
+		last->index = proxy->index;
+		members.pop_back();
+		proxy->index = -1;
+		stale.store(true, std::memory_order_relaxed);
+		if (free) destroyProxy(proxy);
+	}
+
+	void updateProxy(Proxy* proxy, const AABB& aabb) override {
+		if (proxy->aabb == aabb) return;
+		proxy->aabb = aabb;
+		stale.store(true, std::memory_order_relaxed);
+	}
+
+	// rebuilds the hierarchy now instead of on the next query
+	void rebuild() {
+		update();
+	}
+
+	// the same with every pass dealt out over the pool
+	void rebuild(ThreadPool& threads) {
+		std::lock_guard<std::mutex> lock(buildMutex);
+		if (stale.load(std::memory_order_relaxed)) build(&threads);
+	}
+
+	bool isStale() const { return stale.load(std::memory_order_relaxed); }
+
+	// every node, leaves holding their run of proxies
+	void queryStructure(StructureCallback callback, void* context) const override {
+		update();
+		if (!nodes.empty()) queryStructure(0, 0, callback, context);
+	}
+
+#ifdef BROADPHASE_STATS
+	void measureMemory(size_t& used, size_t& reserved) const override {
+		Broadphase::measureMemory(used, reserved);
+		used += members.size() * sizeof(Proxy*) + entries.usedBytes() + nodes.size() * sizeof(Bounds);
+		reserved += members.capacity() * sizeof(Proxy*) + entries.reservedBytes() + nodes.capacity() * sizeof(Bounds) +
+								(keys.capacity() + values.capacity() + sortedKeys.capacity() + sortedValues.capacity() +
+								 histograms.capacity()) * sizeof(uint32_t) + workerBounds.capacity() * sizeof(Bounds);
+	}
+#endif
+
+	void clear() override {
+		members.clear();
+		entries.clear();
+		nodes.clear();
+		leafBase = 0;
+		stale.store(false, std::memory_order_relaxed);
+		releaseProxies();
+	}
+
+	using Broadphase::queryRange;
+
+	template<typename Visitor>
+	bool visitRange(const int x, const int y, const int radius, Visitor&& visit) const {
+		BROADPHASE_STATS_SCOPE();
+		return traverse([&](const Bounds& bounds) {
+			return bounds.intersectsCircle(x, y, radius);
+		}, [&](const size_t leaf) {
+			return entries.forEachCircleHit(leafBegin(leaf), leafEnd(leaf), x, y, radius, [&](const size_t i) {
+				return visit(entries[i]);
+			});
+		});
+	}
+
+	void queryRange(const int x, const int y, const int radius, std::vector<Proxy*>& hits) const override {
+		visitRange(x, y, radius, [&](Proxy* proxy) { hits.push_back(proxy); return true; });
+	}
+
+	bool queryRange(const int x, const int y, const int radius, QueryCallback callback, void* context) const override {
+		return visitRange(x, y, radius, [=](Proxy* proxy) { return callback(proxy, context); });
+	}
+
+	using Broadphase::queryAABB;
+
+	template<typename Visitor>
+	bool visitAABB(const AABB& aabb, Visitor&& visit) const {
+		BROADPHASE_STATS_SCOPE();
+		const int x0 = aabb.getX(), y0 = aabb.getY(),
+							x1 = x0 + aabb.getWidth(), y1 = y0 + aabb.getHeight();
+		return traverse([&](const Bounds& bounds) {
+			return bounds.intersects(x0, y0, x1, y1);
+		}, [&](const size_t leaf) {
+			return entries.forEachAABBHit(leafBegin(leaf), leafEnd(leaf), aabb, [&](const size_t i) {
+				return visit(entries[i]);
+			});
+		});
+	}
+
+	void queryAABB(const AABB& aabb, std::vector<Proxy*>& hits) const override {
+		visitAABB(aabb, [&](Proxy* proxy) { hits.push_back(proxy); return true; });
+	}
+
+	bool queryAABB(const AABB& aabb, QueryCallback callback, void* context) const override {
+		return visitAABB(aabb, [=](Proxy* proxy) { return callback(proxy, context); });
+	}
+
+	using Broadphase::queryCollisionPairs;
+
+	/**
+	 * Every proxy queries the tree with its box and keeps the hits sorted after it, so the leaves
+	 * before its own are passed over without testing their proxies.
+	 */
+	template<typename Visitor>
+	bool visitPairs(Visitor&& visit) const {
+		BROADPHASE_STATS_SCOPE();
+		update();
+		for (size_t i = 0; i < entries.size(); ++i) {
+			Proxy* proxy = entries[i];
+			const AABB& aabb = proxy->aabb;
+			const int x0 = aabb.getX(), y0 = aabb.getY(),
+								x1 = x0 + aabb.getWidth(), y1 = y0 + aabb.getHeight();
+			const size_t own = leafBase + i / leafSize;
+			const bool more = traverse([&](const Bounds& bounds) {
+				return bounds.intersects(x0, y0, x1, y1);
+			}, [&](const size_t leaf) {
+				if (leaf < own) return true;
+				return entries.forEachAABBHit(std::max(i + 1, leafBegin(leaf)), leafEnd(leaf), aabb, [&](const size_t j) {
+					return visit(proxy, entries[j]);
+				});
+			});
+			if (!more) return false;
+		}
+		return true;
+	}
+
+	void queryCollisionPairs(std::vector<ProxyPair>& pairs) const override {
+		visitPairs([&](Proxy* a, Proxy* b) { pairs.emplace_back(a, b); return true; });
+	}
+
+	bool queryCollisionPairs(PairCallback callback, void* context) const override {
+		return visitPairs([=](Proxy* a, Proxy* b) { return callback(a, b, context); });
+	}
+};
+
+#endif // LINEARBVH_HPP
@@ -1,12 +1,15 @@
 #include "MainWindow.hpp"
 #include "Broadphase.hpp"
+#include "PartitionedBroadphase.hpp"
+
+#include <algorithm>
 
 static int randomInt(int low, int high) {
 	return qrand() % ((high + 1) - low) + low;
 }
 
 MainWindow::MainWindow(Broadphase *broadphase, QWidget *parent) :
-	QMainWindow(parent), broadphase(broadphase)
+	QMainWindow(parent), broadphase(broadphase), recorder(*broadphase)
 {
 	QTime time = QTime::currentTime();
 	qsrand((uint)time.msec());
@@ -30,27 +33,36 @@ MainWindow::MainWindow(Broadphase *broadphase, QWidget *parent) :
 		object->setData(0, QPointF(randomInt(-2, 2), randomInt(-2, 2)));
 
 		// add it to the broadphase
-		auto proxy = broadphase->addProxy(
+		auto handle = broadphase->addHandle(
 			AABB(object->x(),object->y(),width,height),
 			object
 		);
 
-		proxies.push_back(proxy);
+		handles.push_back(handle);
 	}
 
-	// create a background grid that shows the buckets
-	QPen gridPen(Qt::black, 5);
-	qreal cellWidth = 64;// broadphase.getCellWidth();
-	qreal cellHeight = 64;// broadphase.getCellHeight();
-	for (qreal x = 0; x <= scene->width(); x += cellWidth)
-		scene->addLine(x, 0, x, scene->height(), gridPen);
-	for (qreal y = 0; y <= scene->height(); y += cellHeight)
-		scene->addLine(0, y, scene->width(), y, gridPen);
+	// the backend's own cells or nodes go behind the objects and the timings in front
+	structure = new StructureItem(scene->sceneRect());
+	structure->setZValue(-1);
+	scene->addItem(structure);
+	overlay = scene->addSimpleText("");
+	overlay->setPos(8, 8);
+	overlay->setZValue(1);
+	overlay->setBrush(Qt::white);
+	overlay->setPen(QPen(Qt::black, 0.5));
+	overlay->setFont(QFont("Monospace", 10, QFont::Bold));
 
 	QTimer *timer = new QTimer(this);
 	connect(timer, SIGNAL(timeout()), this, SLOT(updateGame()));
 	timer->start(0);
 
+	// R starts recording the frames to a trace and stops to save it
+	QShortcut *recordShortcut = new QShortcut(QKeySequence(Qt::Key_R), this);
+	connect(recordShortcut, SIGNAL(activated()), this, SLOT(toggleRecording()));
+	// O shows and hides the structure and timings
+	QShortcut *overlayShortcut = new QShortcut(QKeySequence(Qt::Key_O), this);
+	connect(overlayShortcut, SIGNAL(activated()), this, SLOT(toggleOverlay()));
+
 	view = new QGraphicsView(scene, this);
 	view->setViewportUpdateMode(QGraphicsView::NoViewportUpdate);
 
@@ -64,7 +76,10 @@ MainWindow::~MainWindow()
 }
 
 void MainWindow::updateGame() {
-	for (auto proxy : proxies) {
+	moves.clear();
+	for (auto handle : handles) {
+		auto proxy = broadphase->getProxy(handle);
+		if (!proxy) continue;
 		auto object = (QGraphicsRectItem*)proxy->userdata;
 
 		// move the object around
@@ -79,23 +94,111 @@ void MainWindow::updateGame() {
 		object->setBrush(Qt::darkCyan);
 		object->setPen(QPen(Qt::black));
 
-		broadphase->updateProxy(proxy, aabb);
+		moves.emplace_back(proxy, aabb);
 	}
 
+	// only the broadphase work is timed, not moving the graphics items
+	QElapsedTimer timer;
+	timer.start();
+	for (const auto& move : moves)
+		recorder.updateProxy(move.first, move.second);
+	// the partitioned backend only puts idle proxies to sleep when told a frame ended
+	if (auto partitioned = dynamic_cast<PartitionedBroadphase<SpatialHash>*>(broadphase))
+		partitioned->step();
+	updateTimes.add(timer.nsecsElapsed());
+
 	// now query the cursor and change the color of objects
 	// that hit the player to red
 	player->setPos(view->mapFromGlobal(QCursor::pos() - QPoint(playerRadius, playerRadius)));
-	const auto &hits = broadphase->queryRange(
+	timer.restart();
+	recorder.visitRange(
 				player->x() + playerRadius,
 				player->y() + playerRadius,
-				playerRadius);
-
-	for (const auto &hit : hits) {
+				playerRadius, [](Broadphase::Proxy* hit) {
 		auto other = (QAbstractGraphicsShapeItem*)hit->userdata;
-		if (other == nullptr) continue;
-		other->setBrush(Qt::red);
+		if (other != nullptr) other->setBrush(Qt::red);
+		return true;
+	});
+	queryTimes.add(timer.nsecsElapsed());
+
+	recorder.endFrame();
+
+	if (overlay->isVisible()) {
+		structure->regions.clear();
+		structure->maxCount = 0;
+		size_t occupied = 0, stored = 0;
+		broadphase->visitStructure([&](const AABB& bounds, size_t count, int) {
+			structure->regions.push_back(StructureItem::Region{
+				QRectF(bounds.getX(), bounds.getY(), bounds.getWidth(), bounds.getHeight()), count});
+			structure->maxCount = std::max(structure->maxCount, count);
+			if (count) ++occupied;
+			stored += count;
+		});
+
+		auto ms = [](qint64 time) { return QString::number(time / 1e6, 'f', 3); };
+		overlay->setText(QString(
+			"update %1 ms  p50 %2  p99 %3\n"
+			"query  %4 ms  p50 %5  p99 %6\n"
+			"%7 regions, %8 occupied, %9 proxies each, at most %10")
+			.arg(ms(updateTimes.last))
+			.arg(ms(updateTimes.percentile(0.5))).arg(ms(updateTimes.percentile(0.99)))
+			.arg(ms(queryTimes.last))
+			.arg(ms(queryTimes.percentile(0.5))).arg(ms(queryTimes.percentile(0.99)))
+			.arg(structure->regions.size()).arg(occupied)
+			.arg(occupied ? (double) stored / occupied : 0.0, 0, 'f', 1).arg(structure->maxCount));
 	}
 
 	// do the repainting manually
 	view->viewport()->update();
 }
+
+void MainWindow::toggleRecording() {
+	if (!recorder.isRecording()) {
+		recorder.start();
+		this->setWindowTitle(this->windowTitle() + " (Recording)");
+		return;
+	}
+	recorder.stop();
+	this->setWindowTitle(this->windowTitle().remove(" (Recording)"));
+	QString path = QFileDialog::getSaveFileName(this, "Save Trace", "session.trace", "Traces (*.trace)");
+	if (!path.isEmpty() && !recorder.save(path.toStdString()))
+		QMessageBox::warning(this, "Save Trace", "Could not write " + path);
+}
+
+void MainWindow::toggleOverlay() {
+	const bool visible = !overlay->isVisible();
+	overlay->setVisible(visible);
+	structure->setVisible(visible);
+}
+
+void MainWindow::FrameTimes::add(qint64 time) {
+	// about four seconds at 60 frames per second
+	if (samples.size() < 240) samples.push_back(time);
+	else samples[next] = time;
+	last = time;
+	next = (next + 1) % 240;
+}
+
+qint64 MainWindow::FrameTimes::percentile(double p) const {
+	if (samples.empty()) return 0;
+	std::vector<qint64> sorted(samples);
+	const size_t rank = std::min(sorted.size() - 1, (size_t) (p * sorted.size()));
+	std::nth_element(sorted.begin(), sorted.begin() + rank, sorted.end());
+	return sorted[rank];
+}
+
+void StructureItem::paint(QPainter *painter, const QStyleOptionGraphicsItem *option, QWidget *widget) {
+	Q_UNUSED(option);
+	Q_UNUSED(widget);
+	painter->setPen(QPen(Qt::black, 1));
+	for (const auto& region : regions) {
+		if (!region.count) {
+			painter->setBrush(Qt::NoBrush);
+		} else {
+			// green for a single proxy through to red for the fullest region
+			const qreal heat = maxCount > 1 ? (qreal) (region.count - 1) / (maxCount - 1) : 0;
+			painter->setBrush(QColor::fromHsvF((1 - heat) / 3, 1, 1, 0.35));
+		}
+		painter->drawRect(region.rect);
+	}
+}
@@ -2,6 +2,7 @@
 #define MAINWINDOW_HPP
 
 #include "Broadphase.hpp"
+#include "Trace.hpp"
 
 #include <QtWidgets>
 
@@ -11,6 +12,27 @@ namespace Ui {
 class MainWindow;
 }
 
+// draws the cells or nodes of a broadphase, shaded from green to red by how many proxies each holds
+class StructureItem : public QGraphicsItem
+{
+public:
+	struct Region {
+		QRectF rect;
+		size_t count;
+	};
+
+	std::vector<Region> regions;
+	size_t maxCount = 0;
+
+	explicit StructureItem(const QRectF &bounds) : bounds(bounds) {}
+
+	QRectF boundingRect() const override { return bounds; }
+	void paint(QPainter *painter, const QStyleOptionGraphicsItem *option, QWidget *widget) override;
+
+private:
+	QRectF bounds;
+};
+
 class MainWindow : public QMainWindow
 {
 	Q_OBJECT
@@ -21,14 +43,31 @@ public:
 
 public slots:
 	void updateGame();
+	void toggleRecording();
+	void toggleOverlay();
 
 private:
+	// the last few seconds of one step's timings in nanoseconds, for rolling percentiles
+	struct FrameTimes {
+		std::vector<qint64> samples;
+		size_t next = 0;
+		qint64 last = 0;
+
+		void add(qint64 time);
+		qint64 percentile(double p) const;
+	};
+
 	QGraphicsScene* scene;
 	Broadphase *broadphase;
-	std::vector<Broadphase::Proxy*> proxies;
+	TraceRecorder recorder;
+	std::vector<Broadphase::Handle> handles;
 	QGraphicsEllipseItem *player;
 	qreal playerRadius = 50.0f;
 	QGraphicsView *view;
+	StructureItem *structure;
+	QGraphicsSimpleTextItem *overlay;
+	FrameTimes updateTimes, queryTimes;
+	std::vector<std::pair<Broadphase::Proxy*, AABB>> moves;
 };
 
 #endif // MAINWINDOW_HPP
@@ -0,0 +1,166 @@
+/**
+ * @file PairManager.hpp
+ * @brief Implements a persistent overlapping pair cache reporting contact begin and end events.
+ * @section License
+ * Copyright (C) 2020 Robert Colton
+ * License pending. All rights reserved.
+ */
+
+#ifndef PAIRMANAGER_HPP
+#define PAIRMANAGER_HPP
+
+#include "Broadphase.hpp"
+
+#include <algorithm>
+#include <vector>
+
+/*
+ * Proxies are added, moved and removed through the manager, which forwards to the broadphase and
+ * remembers which proxies moved since the last update. update() then only looks at those: each moved
+ * proxy retests the contacts it already has and queries the broadphase with its new AABB for new
+ * ones. Contacts between proxies that did not move are kept as they are without any test, so the
+ * cost of a frame follows the amount of motion rather than the number of proxies. Contacts are kept
+ * as a short list per proxy, indexed by the proxy's handle slot.
+ */
+
+class PairManager {
+	typedef Broadphase::Proxy Proxy;
+	typedef Broadphase::Handle Handle;
+
+public:
+	struct Contact {
+		Handle a, b;
+		void* userdataA;
+		void* userdataB;
+	};
+
+private:
+	Broadphase& broadphase;
+	std::vector<std::vector<Proxy*>> contacts; // indexed by proxy id
+	std::vector<Proxy*> moved;
+	std::vector<int> movedSlot; // each proxy's slot in moved, or -1
+	std::vector<Contact> pendingEnds; // contacts of removed proxies, reported next update
+	std::vector<Proxy*> hits;
+	size_t contactCount = 0;
+
+	void track(const Proxy* proxy) {
+		if (contacts.size() <= proxy->id) {
+			contacts.resize(proxy->id + 1);
+			movedSlot.resize(proxy->id + 1, -1);
+		}
+	}
+
+	void markMoved(Proxy* proxy) {
+		int& slot = movedSlot[proxy->id];
+		if (slot >= 0) return;
+		slot = (int) moved.size();
+		moved.push_back(proxy);
+	}
+
+	Contact makeContact(const Proxy* a, const Proxy* b) const {
+		return Contact{broadphase.getHandle(a), broadphase.getHandle(b), a->userdata, b->userdata};
+	}
+
+	static void unlink(std::vector<Proxy*>& list, const Proxy* proxy) {
+		auto it = std::find(list.begin(), list.end(), proxy);
+		*it = list.back();
+		list.pop_back();
+	}
+
+public:
+	explicit PairManager(Broadphase& broadphase): broadphase(broadphase) {}
+
+	Broadphase& getBroadphase() const { return broadphase; }
+	size_t getContactCount() const { return contactCount; }
+
+	// the proxies currently overlapping the given one
+	const std::vector<Proxy*>& getContacts(const Proxy* proxy) const { return contacts[proxy->id]; }
+
+	Proxy* addProxy(const AABB& aabb, void* userdata = nullptr) {
+		Proxy* proxy = broadphase.addProxy(aabb, userdata);
+		if (!proxy) return nullptr;
+		track(proxy);
+		markMoved(proxy);
+		return proxy;
+	}
+
+	void updateProxy(Proxy* proxy, const AABB& aabb) {
+		if (proxy->aabb == aabb) return;
+		broadphase.updateProxy(proxy, aabb);
+		markMoved(proxy);
+	}
+
+	// the removed proxy's contacts end with the next update
+	void removeProxy(Proxy* proxy) {
+		auto& list = contacts[proxy->id];
+		for (auto other : list) {
+			pendingEnds.push_back(makeContact(proxy, other));
+			unlink(contacts[other->id], proxy);
+		}
+		contactCount -= list.size();
+		list.clear();
+
+		int& slot = movedSlot[proxy->id];
+		if (slot >= 0) {
+			moved[slot] = moved.back();
+			movedSlot[moved[slot]->id] = slot;
+			moved.pop_back();
+			slot = -1;
+		}
+		broadphase.removeProxy(proxy);
+	}
+
+	/**
+	 * Appends the contacts that began and ended since the last update. A pair that both began and
+	 * ended in between, or that separated and touched again, is not reported.
+	 */
+	void update(std::vector<Contact>& began, std::vector<Contact>& ended) {
+		ended.insert(ended.end(), pendingEnds.begin(), pendingEnds.end());
+		pendingEnds.clear();
+
+		for (auto proxy : moved) {
+			// drop the contacts the move separated
+			auto& list = contacts[proxy->id];
+			for (size_t i = 0; i < list.size();) {
+				Proxy* other = list[i];
+				if (proxy->aabb.intersectsAABB(other->aabb)) {
+					++i;
+					continue;
+				}
+				ended.push_back(makeContact(proxy, other));
+				unlink(contacts[other->id], proxy);
+				list[i] = list.back();
+				list.pop_back();
+				--contactCount;
+			}
+
+			// and pick up the ones it made
+			hits.clear();
+			broadphase.queryAABB(proxy->aabb, hits);
+			for (auto other : hits) {
+				if (other == proxy || std::find(list.begin(), list.end(), other) != list.end()) continue;
+				began.push_back(makeContact(proxy, other));
+				list.push_back(other);
+				contacts[other->id].push_back(proxy);
+				++contactCount;
+			}
+		}
+
+		for (auto proxy : moved)
+			movedSlot[proxy->id] = -1;
+		moved.clear();
+	}
+
+	// removes every proxy from the broadphase without reporting any contact as ended
+	void clear() {
+		for (auto& list : contacts)
+			list.clear();
+		std::fill(movedSlot.begin(), movedSlot.end(), -1);
+		moved.clear();
+		pendingEnds.clear();
+		contactCount = 0;
+		broadphase.clear();
+	}
+};
+
+#endif // PAIRMANAGER_HPP
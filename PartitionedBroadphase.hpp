@@ -0,0 +1,395 @@
+/**
+ * @file PartitionedBroadphase.hpp
+ * @brief Implements a broadphase splitting static, sleeping and awake proxies apart.
+ * @section License
+ * Copyright (C) 2020 Robert Colton
+ * License pending. All rights reserved.
+ */
+
+#ifndef PARTITIONEDBROADPHASE_HPP
+#define PARTITIONEDBROADPHASE_HPP
+
+#include "Broadphase.hpp"
+#include "ProxyBatch.hpp"
+#include "SpatialHash.hpp"
+
+#include <algorithm>
+#include <climits>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+/*
+ * Static Partitioning
+ *
+ * Dynamic proxies live in an ordinary backend while static proxies are kept out of it in a single run
+ * sorted by their left edge, so a query binary searches the run and then filters one contiguous
+ * stretch of it with the batch kernels. The run is only rebuilt by step() after statics were added or
+ * moved, and until then those wait in a short unsorted list that queries scan directly. Dynamic proxies
+ * that go sleepFrames steps without moving fall asleep and wake up again the moment they are moved.
+ *
+ * The dynamic proxies are linked into the backend rather than owned by it. Removing a sorted static
+ * only leaves a gap in the run, which queries skip and the next step() closes.
+ *
+ * Pair finding is driven by the awake proxies alone, each querying both partitions, so static against
+ * static and sleeping against sleeping or static pairs are never tested. Those pairs cannot have
+ * changed since their proxies stopped moving, so the pair queries only report the pairs with an awake
+ * proxy. The all pair queries still report every overlapping pair, for checking against other backends.
+ */
+
+template<typename Dynamic = SpatialHash>
+class PartitionedBroadphase : public Broadphase {
+	enum Kind : uint8_t { Awake, Sleeping, Static, PendingStatic };
+
+	struct State {
+		Kind kind;
+		bool moved;
+		int idle; // steps gone without moving
+		int slot; // position in the awake list while awake
+	};
+
+	Dynamic dynamicIndex;
+	std::vector<State> states; // indexed by proxy id
+	std::vector<Proxy*> awake;
+	// statics sorted by left edge with each proxy's index as its position, plus the ones not sorted in yet
+	ProxyBatch statics, pendingStatics;
+	size_t removedStatics = 0; // gaps left in the sorted run
+	std::vector<Proxy*> scratch;
+	int staticMaxWidth = 0;
+	int sleepFrames;
+
+	State& track(const Proxy* proxy) {
+		if (states.size() <= proxy->id) states.resize(proxy->id + 1);
+		return states[proxy->id];
+	}
+
+	void wake(Proxy* proxy, State& state) {
+		state.kind = Awake;
+		state.moved = true;
+		state.idle = 0;
+		state.slot = (int) awake.size();
+		awake.push_back(proxy);
+	}
+
+	void unlinkAwake(State& state) {
+		Proxy* last = awake.back();
+		awake[state.slot] = last;
+		states[last->id].slot = state.slot;
+		awake.pop_back();
+	}
+
+	void addStatic(Proxy* proxy, State& state) {
+		state.kind = PendingStatic;
+		proxy->index = (int) pendingStatics.size();
+		pendingStatics.push_back(proxy);
+	}
+
+	void removeStatic(Proxy* proxy, const State& state) {
+		if (state.kind == PendingStatic) {
+			Proxy* last = pendingStatics.back();
+			pendingStatics.set(proxy->index, last);
+			last->index = proxy->index;
+			pendingStatics.pop_back();
+		} else {
+			statics.vacate(proxy->index);
+			++removedStatics;
+		}
+		proxy->index = -1;
+	}
+
+	// the stretch of the sorted run whose left edges fall within [x0 - staticMaxWidth, x1]
+	std::pair<size_t, size_t> staticSpan(const int x0, const int x1) const {
+		const int* minX = statics.minX();
+		const int* end = minX + statics.size();
+		return std::make_pair((size_t) (std::lower_bound(minX, end, x0 - staticMaxWidth) - minX),
+													(size_t) (std::upper_bound(minX, end, x1) - minX));
+	}
+
+	template<typename Visitor>
+	bool visitStaticRange(const int x, const int y, const int radius, Visitor&& visit) const {
+		const auto span = staticSpan(x - radius, x + radius);
+		return statics.forEachCircleHit(span.first, span.second, x, y, radius, [&](const size_t i) {
+			return !statics[i] || visit(statics[i]);
+		}) && pendingStatics.forEachCircleHit(0, pendingStatics.size(), x, y, radius, [&](const size_t i) {
+			return visit(pendingStatics[i]);
+		});
+	}
+
+	template<typename Visitor>
+	bool visitStaticAABB(const AABB& aabb, Visitor&& visit) const {
+		const auto span = staticSpan(aabb.getX(), aabb.getX() + aabb.getWidth());
+		return statics.forEachAABBHit(span.first, span.second, aabb, [&](const size_t i) {
+			return !statics[i] || visit(statics[i]);
+		}) && pendingStatics.forEachAABBHit(0, pendingStatics.size(), aabb, [&](const size_t i) {
+			return visit(pendingStatics[i]);
+		});
+	}
+
+public:
+	// the remaining arguments are passed on to the dynamic backend
+	template<typename... Args>
+	explicit PartitionedBroadphase(const int sleepFrames = 60, Args&&... args):
+		Broadphase(), dynamicIndex(std::forward<Args>(args)...), sleepFrames(sleepFrames) {}
+	~PartitionedBroadphase() { clear(); }
+
+	Dynamic& getDynamicIndex() { return dynamicIndex; }
+	int getSleepFrames() const { return sleepFrames; }
+	void setSleepFrames(const int sleepFrames) { this->sleepFrames = sleepFrames; }
+
+	size_t getAwakeCount() const { return awake.size(); }
+	size_t getStaticCount() const { return statics.size() - removedStatics + pendingStatics.size(); }
+
+	bool isStatic(const Proxy* proxy) const {
+		const Kind kind = states[proxy->id].kind;
+		return kind == Static || kind == PendingStatic;
+	}
+
+	bool isSleeping(const Proxy* proxy) const {
+		return states[proxy->id].kind == Sleeping;
+	}
+
+	using Broadphase::addProxy;
+
+protected:
+	Proxy* addProxy(Proxy* proxy) override {
+		if (!dynamicIndex.linkProxy(proxy)) return nullptr;
+		wake(proxy, track(proxy));
+		return proxy;
+	}
+
+public:
+	Proxy* addStatic(const AABB& aabb, void* userdata = nullptr) {
+		Proxy* proxy = createProxy(aabb, userdata);
+		addStatic(proxy, track(proxy));
+		return proxy;
+	}
+
+	// moves a proxy between the partitions, a proxy made dynamic starts out awake
+	void setStatic(Proxy* proxy, const bool makeStatic) {
+		State& state = states[proxy->id];
+		if (makeStatic == isStatic(proxy)) return;
+		if (makeStatic) {
+			if (state.kind == Awake) unlinkAwake(state);
+			dynamicIndex.unlinkProxy(proxy);
+			addStatic(proxy, state);
+			return;
+		}
+		removeStatic(proxy, state);
+		// stay static if the dynamic backend has no room for it
+		if (dynamicIndex.linkProxy(proxy)) wake(proxy, state);
+		else addStatic(proxy, state);
+	}
+
+	void wake(Proxy* proxy) {
+		State& state = states[proxy->id];
+		if (state.kind == Sleeping) wake(proxy, state);
+	}
+
+	void removeProxy(Proxy* proxy, bool free = true) override {
+		State& state = states[proxy->id];
+		if (isStatic(proxy)) {
+			removeStatic(proxy, state);
+		} else {
+			if (state.kind == Awake) unlinkAwake(state);
+			dynamicIndex.unlinkProxy(proxy);
+		}
+		if (free) destroyProxy(proxy);
+	}
+
+	void updateProxy(Proxy* proxy, const AABB& aabb) override {
+		if (proxy->aabb == aabb) return;
+		State& state = states[proxy->id];
+		if (isStatic(proxy)) {
+			removeStatic(proxy, state);
+			proxy->aabb = aabb;
+			addStatic(proxy, state);
+			return;
+		}
+		dynamicIndex.updateProxy(proxy, aabb);
+		if (state.kind == Sleeping) wake(proxy, state);
+		state.moved = true;
+	}
+
+	/**
+	 * Ends a frame: awake proxies that have not moved for sleepFrames steps fall asleep, and statics
+	 * added, moved or removed since the last step are sorted into the static run.
+	 */
+	void step() {
+		for (size_t i = 0; i < awake.size();) {
+			State& state = states[awake[i]->id];
+			if (state.moved) {
+				state.moved = false;
+				state.idle = 0;
+			} else if (++state.idle >= sleepFrames) {
+				unlinkAwake(state);
+				state.kind = Sleeping;
+				continue;
+			}
+			++i;
+		}
+		if (!pendingStatics.empty() || removedStatics) rebuildStatics();
+	}
+
+	void rebuildStatics() {
+		scratch.clear();
+		for (auto proxy : statics)
+			if (proxy) scratch.push_back(proxy);
+		scratch.insert(scratch.end(), pendingStatics.begin(), pendingStatics.end());
+		std::sort(scratch.begin(), scratch.end(), [](const Proxy* a, const Proxy* b) {
+			return a->aabb.getX() < b->aabb.getX();
+		});
+		statics.clear();
+		pendingStatics.clear();
+		removedStatics = 0;
+		staticMaxWidth = 0;
+		for (auto proxy : scratch) {
+			proxy->index = (int) statics.size();
+			statics.push_back(proxy);
+			states[proxy->id].kind = Static;
+			staticMaxWidth = std::max(staticMaxWidth, proxy->aabb.getWidth());
+		}
+	}
+
+	// the dynamic backend's structure, then all the statics as one region around them
+	void queryStructure(StructureCallback callback, void* context) const override {
+		dynamicIndex.queryStructure(callback, context);
+		if (!getStaticCount()) return;
+		int x0 = INT_MAX, y0 = INT_MAX, x1 = INT_MIN, y1 = INT_MIN;
+		for (const ProxyBatch* batch : { &statics, &pendingStatics }) {
+			for (auto proxy : *batch) {
+				if (!proxy) continue;
+				const AABB& aabb = proxy->aabb;
+				x0 = std::min(x0, aabb.getX());
+				y0 = std::min(y0, aabb.getY());
+				x1 = std::max(x1, aabb.getX() + aabb.getWidth());
+				y1 = std::max(y1, aabb.getY() + aabb.getHeight());
+			}
+		}
+		callback(AABB(x0, y0, x1 - x0, y1 - y0), getStaticCount(), 0, context);
+	}
+
+#ifdef BROADPHASE_STATS
+	void measureMemory(size_t& used, size_t& reserved) const override {
+		Broadphase::measureMemory(used, reserved);
+		dynamicIndex.measureMemory(used, reserved);
+		used += statics.usedBytes() + pendingStatics.usedBytes() +
+						states.size() * sizeof(State) + awake.size() * sizeof(Proxy*);
+		reserved += statics.reservedBytes() + pendingStatics.reservedBytes() + states.capacity() * sizeof(State) +
+								(awake.capacity() + scratch.capacity()) * sizeof(Proxy*);
+	}
+#endif
+
+	void clear() override {
+		dynamicIndex.clear();
+		states.clear();
+		awake.clear();
+		statics.clear();
+		pendingStatics.clear();
+		removedStatics = 0;
+		staticMaxWidth = 0;
+		releaseProxies();
+	}
+
+	using Broadphase::queryRange;
+
+	template<typename Visitor>
+	bool visitRange(const int x, const int y, const int radius, Visitor&& visit) const {
+		BROADPHASE_STATS_SCOPE();
+		return dynamicIndex.visitRange(x, y, radius, visit) && visitStaticRange(x, y, radius, visit);
+	}
+
+	void queryRange(const int x, const int y, const int radius, std::vector<Proxy*>& hits) const override {
+		visitRange(x, y, radius, [&](Proxy* proxy) { hits.push_back(proxy); return true; });
+	}
+
+	bool queryRange(const int x, const int y, const int radius, QueryCallback callback, void* context) const override {
+		return visitRange(x, y, radius, [=](Proxy* proxy) { return callback(proxy, context); });
+	}
+
+	using Broadphase::queryAABB;
+
+	template<typename Visitor>
+	bool visitAABB(const AABB& aabb, Visitor&& visit) const {
+		BROADPHASE_STATS_SCOPE();
+		return dynamicIndex.visitAABB(aabb, visit) && visitStaticAABB(aabb, visit);
+	}
+
+	void queryAABB(const AABB& aabb, std::vector<Proxy*>& hits) const override {
+		visitAABB(aabb, [&](Proxy* proxy) { hits.push_back(proxy); return true; });
+	}
+
+	bool queryAABB(const AABB& aabb, QueryCallback callback, void* context) const override {
+		return visitAABB(aabb, [=](Proxy* proxy) { return callback(proxy, context); });
+	}
+
+	using Broadphase::queryCollisionPairs;
+
+	// only the pairs with at least one awake proxy, see above
+	template<typename Visitor>
+	bool visitPairs(Visitor&& visit) const {
+		BROADPHASE_STATS_SCOPE();
+		for (auto proxy : awake) {
+			const bool more = dynamicIndex.visitAABB(proxy->aabb, [&](Proxy* other) {
+				// a pair of awake proxies is reported by the one with the lower id
+				if (other == proxy) return true;
+				if (states[other->id].kind == Awake && other->id < proxy->id) {
+					BROADPHASE_COUNT(duplicates, 1);
+					return true;
+				}
+				return visit(proxy, other);
+			}) && visitStaticAABB(proxy->aabb, [&](Proxy* other) {
+				return visit(proxy, other);
+			});
+			if (!more) return false;
+		}
+		return true;
+	}
+
+	void queryCollisionPairs(std::vector<ProxyPair>& pairs) const override {
+		visitPairs([&](Proxy* a, Proxy* b) { pairs.emplace_back(a, b); return true; });
+	}
+
+	bool queryCollisionPairs(PairCallback callback, void* context) const override {
+		return visitPairs([=](Proxy* a, Proxy* b) { return callback(a, b, context); });
+	}
+
+	// the dynamic pairs from the backend, then every static against the dynamics and later statics
+	template<typename Visitor>
+	bool visitAllPairs(Visitor&& visit) const {
+		BROADPHASE_STATS_SCOPE();
+		if (!dynamicIndex.visitPairs(visit)) return false;
+		const int* minX = statics.minX();
+		for (size_t i = 0; i < statics.size(); ++i) {
+			Proxy* proxy = statics[i];
+			if (!proxy) continue;
+			const AABB& aabb = proxy->aabb;
+			// later statics in the run start at or after this one, so stop at its right edge
+			const size_t last = std::upper_bound(minX + i + 1, minX + statics.size(),
+																					 aabb.getX() + aabb.getWidth()) - minX;
+			auto pair = [&](Proxy* other) { return visit(proxy, other); };
+			const bool more = dynamicIndex.visitAABB(aabb, pair) &&
+					statics.forEachAABBHit(i + 1, last, aabb, [&](const size_t j) {
+						return !statics[j] || visit(proxy, statics[j]);
+					}) && pendingStatics.forEachAABBHit(0, pendingStatics.size(), aabb, [&](const size_t j) {
+						return visit(proxy, pendingStatics[j]);
+					});
+			if (!more) return false;
+		}
+		for (size_t i = 0; i < pendingStatics.size(); ++i) {
+			Proxy* proxy = pendingStatics[i];
+			auto pair = [&](Proxy* other) { return visit(proxy, other); };
+			const bool more = dynamicIndex.visitAABB(proxy->aabb, pair) &&
+					pendingStatics.forEachAABBHit(i + 1, pendingStatics.size(), proxy->aabb, [&](const size_t j) {
+						return visit(proxy, pendingStatics[j]);
+					});
+			if (!more) return false;
+		}
+		return true;
+	}
+
+	void queryAllPairs(std::vector<ProxyPair>& pairs) const {
+		visitAllPairs([&](Proxy* a, Proxy* b) { pairs.emplace_back(a, b); return true; });
+	}
+};
+
+#endif // PARTITIONEDBROADPHASE_HPP
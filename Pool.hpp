@@ -0,0 +1,86 @@
+/**
+ * @file Pool.hpp
+ * @brief Implements a slab allocator for fixed size broadphase objects.
+ * @section License
+ * Copyright (C) 2020 Robert Colton
+ * License pending. All rights reserved.
+ */
+
+#ifndef POOL_HPP
+#define POOL_HPP
+
+#include <cstddef>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+/*
+ * Objects are carved out of slabs of SlabSize slots and freed slots are threaded onto an intrusive
+ * free list, so steady state creation and destruction never reach malloc. Since the objects are
+ * trivially destructible, clear() releases every object at once by rewinding to the first slab and
+ * keeps the slabs around for the next fill.
+ */
+
+template<typename T, size_t SlabSize = 512>
+class Pool {
+	static_assert(std::is_trivially_destructible<T>::value,
+								"pooled objects are released without running their destructors");
+
+	union Slot {
+		Slot* next;
+		typename std::aligned_storage<sizeof(T), alignof(T)>::type storage;
+	};
+
+	std::vector<std::unique_ptr<Slot[]>> slabs;
+	Slot* freeList = nullptr;
+	size_t slab = 0, offset = 0; // the next never used slot
+	size_t live = 0;
+
+public:
+	Pool() {}
+	Pool(const Pool&) = delete;
+	Pool& operator=(const Pool&) = delete;
+
+	template<typename... Args>
+	T* create(Args&&... args) {
+		Slot* slot = freeList;
+		if (slot) {
+			freeList = slot->next;
+		} else {
+			if (slab == slabs.size()) slabs.emplace_back(new Slot[SlabSize]);
+			slot = &slabs[slab][offset];
+			if (++offset == SlabSize) {
+				++slab;
+				offset = 0;
+			}
+		}
+		++live;
+		return new (&slot->storage) T(std::forward<Args>(args)...);
+	}
+
+	void destroy(T* object) {
+		Slot* slot = reinterpret_cast<Slot*>(object);
+		slot->next = freeList;
+		freeList = slot;
+		--live;
+	}
+
+	void clear() {
+		freeList = nullptr;
+		slab = offset = 0;
+		live = 0;
+	}
+
+	void release() {
+		clear();
+		slabs.clear();
+	}
+
+	size_t size() const { return live; }
+	size_t capacity() const { return slabs.size() * SlabSize; }
+	size_t reservedBytes() const { return capacity() * sizeof(Slot); }
+};
+
+#endif // POOL_HPP
@@ -0,0 +1,291 @@
+/**
+ * @file ProxyBatch.hpp
+ * @brief Implements a structure of arrays proxy list with vectorized bounds tests.
+ * @section License
+ * Copyright (C) 2020 Robert Colton
+ * License pending. All rights reserved.
+ */
+
+#ifndef PROXYBATCH_HPP
+#define PROXYBATCH_HPP
+
+#include "Broadphase.hpp"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <new>
+
+/*
+ * Leaves and cells keep the bounds of their proxies in four separate min/max arrays next to the
+ * proxy pointers, so candidate filtering streams through plain integers instead of chasing every
+ * proxy. The kernels test 8 boxes per instruction with AVX2 or 4 with SSE4.1, whichever the build
+ * enables, and write one hit bit per box. Defining BROADPHASE_SCALAR keeps the plain C++ loop.
+ */
+
+#if !defined(BROADPHASE_SCALAR) && defined(__AVX2__)
+#define BROADPHASE_AVX2
+#include <immintrin.h>
+#elif !defined(BROADPHASE_SCALAR) && defined(__SSE4_1__)
+#define BROADPHASE_SSE4
+#include <smmintrin.h>
+#endif
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+class ProxyBatch {
+	typedef Broadphase::Proxy Proxy;
+
+	// one block holding the proxy pointers followed by the minX, minY, maxX and maxY arrays
+	void* data = nullptr;
+	Proxy** proxies = nullptr;
+	int* bounds = nullptr;
+	size_t count = 0, capacity = 0;
+
+	enum { chunk = 256 }; // boxes filtered per mask buffer
+
+	int* array(const size_t i) const { return bounds + i * capacity; }
+
+	// allocates through operator new, so running out throws bad_alloc and allocation counters see it
+	void grow() {
+		const size_t newCapacity = capacity ? capacity * 2 : 8;
+		void* newData = ::operator new(newCapacity * (sizeof(Proxy*) + 4 * sizeof(int)));
+		Proxy** newProxies = static_cast<Proxy**>(newData);
+		int* newBounds = reinterpret_cast<int*>(newProxies + newCapacity);
+		if (count) {
+			std::memcpy(newProxies, proxies, count * sizeof(Proxy*));
+			for (size_t i = 0; i < 4; ++i)
+				std::memcpy(newBounds + i * newCapacity, array(i), count * sizeof(int));
+		}
+		::operator delete(data);
+		data = newData;
+		proxies = newProxies;
+		bounds = newBounds;
+		capacity = newCapacity;
+	}
+
+	static bool circleTest(const int minX, const int minY, const int maxX, const int maxY,
+												 const int x, const int y, const int radius) {
+		const int dx = x - std::max(minX, std::min(x, maxX)),
+							dy = y - std::max(minY, std::min(y, maxY));
+		return dx * dx + dy * dy <= radius * radius;
+	}
+
+	static bool aabbTest(const int minX, const int minY, const int maxX, const int maxY,
+											 const int x0, const int y0, const int x1, const int y1) {
+		return x0 <= maxX && x1 >= minX && y0 <= maxY && y1 >= minY;
+	}
+
+public:
+	ProxyBatch() {}
+	~ProxyBatch() { ::operator delete(data); }
+	ProxyBatch(const ProxyBatch&) = delete;
+	ProxyBatch& operator=(const ProxyBatch&) = delete;
+	ProxyBatch(ProxyBatch&& other) noexcept { swap(other); }
+	ProxyBatch& operator=(ProxyBatch&& other) noexcept {
+		swap(other);
+		return *this;
+	}
+
+	void swap(ProxyBatch& other) noexcept {
+		std::swap(data, other.data);
+		std::swap(proxies, other.proxies);
+		std::swap(bounds, other.bounds);
+		std::swap(count, other.count);
+		std::swap(capacity, other.capacity);
+	}
+
+	size_t size() const { return count; }
+	bool empty() const { return count == 0; }
+	size_t usedBytes() const { return count * (sizeof(Proxy*) + 4 * sizeof(int)); }
+	size_t reservedBytes() const { return capacity * (sizeof(Proxy*) + 4 * sizeof(int)); }
+	void clear() { count = 0; }
+
+	Proxy* operator[](const size_t i) const { return proxies[i]; }
+	Proxy* back() const { return proxies[count - 1]; }
+	Proxy* const* begin() const { return proxies; }
+	Proxy* const* end() const { return proxies + count; }
+
+	const int* minX() const { return array(0); }
+	const int* minY() const { return array(1); }
+	const int* maxX() const { return array(2); }
+	const int* maxY() const { return array(3); }
+
+	void set(const size_t i, Proxy* proxy) {
+		proxies[i] = proxy;
+		refresh(i);
+	}
+
+	// copies the proxy's current AABB into the bounds arrays
+	void refresh(const size_t i) {
+		const AABB& aabb = proxies[i]->aabb;
+		array(0)[i] = aabb.getX();
+		array(1)[i] = aabb.getY();
+		array(2)[i] = aabb.getX() + aabb.getWidth();
+		array(3)[i] = aabb.getY() + aabb.getHeight();
+	}
+
+	void push_back(Proxy* proxy) {
+		if (count == capacity) grow();
+		set(count++, proxy);
+	}
+
+	void pop_back() { --count; }
+
+	// leaves entry i in place without a proxy, for callers that skip the gap until they compact
+	void vacate(const size_t i) { proxies[i] = nullptr; }
+
+	// sets the size without filling the new entries, which the caller then does with set()
+	void resize(const size_t size) {
+		while (capacity < size) grow();
+		count = size;
+	}
+
+	// removes entry i and shifts the rest down, keeping their order
+	void erase(const size_t i) {
+		const size_t tail = count - i - 1;
+		std::memmove(proxies + i, proxies + i + 1, tail * sizeof(Proxy*));
+		for (size_t a = 0; a < 4; ++a)
+			std::memmove(array(a) + i, array(a) + i + 1, tail * sizeof(int));
+		--count;
+	}
+
+	/**
+	 * Sets bit i % 32 of masks[i / 32] for every box i that intersects the circle, using the same
+	 * closest point test as AABB::intersectsCircle.
+	 */
+	static void circleMask(const int* minX, const int* minY, const int* maxX, const int* maxY,
+												 const size_t count, const int x, const int y, const int radius, uint32_t* masks) {
+		std::fill(masks, masks + (count + 31) / 32, 0u);
+		size_t i = 0;
+#if defined(BROADPHASE_AVX2)
+		const __m256i vx = _mm256_set1_epi32(x), vy = _mm256_set1_epi32(y),
+				vr = _mm256_set1_epi32(radius * radius);
+		for (; i + 8 <= count; i += 8) {
+			const __m256i nx = _mm256_max_epi32(_mm256_loadu_si256((const __m256i*) (minX + i)),
+					_mm256_min_epi32(vx, _mm256_loadu_si256((const __m256i*) (maxX + i)))),
+					ny = _mm256_max_epi32(_mm256_loadu_si256((const __m256i*) (minY + i)),
+					_mm256_min_epi32(vy, _mm256_loadu_si256((const __m256i*) (maxY + i))));
+			const __m256i dx = _mm256_sub_epi32(vx, nx), dy = _mm256_sub_epi32(vy, ny);
+			const __m256i d = _mm256_add_epi32(_mm256_mullo_epi32(dx, dx), _mm256_mullo_epi32(dy, dy));
+			const uint32_t miss = (uint32_t) _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpgt_epi32(d, vr)));
+			masks[i / 32] |= (~miss & 0xFFu) << (i % 32);
+		}
+#elif defined(BROADPHASE_SSE4)
+		const __m128i vx = _mm_set1_epi32(x), vy = _mm_set1_epi32(y),
+				vr = _mm_set1_epi32(radius * radius);
+		for (; i + 4 <= count; i += 4) {
+			const __m128i nx = _mm_max_epi32(_mm_loadu_si128((const __m128i*) (minX + i)),
+					_mm_min_epi32(vx, _mm_loadu_si128((const __m128i*) (maxX + i)))),
+					ny = _mm_max_epi32(_mm_loadu_si128((const __m128i*) (minY + i)),
+					_mm_min_epi32(vy, _mm_loadu_si128((const __m128i*) (maxY + i))));
+			const __m128i dx = _mm_sub_epi32(vx, nx), dy = _mm_sub_epi32(vy, ny);
+			const __m128i d = _mm_add_epi32(_mm_mullo_epi32(dx, dx), _mm_mullo_epi32(dy, dy));
+			const uint32_t miss = (uint32_t) _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpgt_epi32(d, vr)));
+			masks[i / 32] |= (~miss & 0xFu) << (i % 32);
+		}
+#endif
+		for (; i < count; ++i)
+			if (circleTest(minX[i], minY[i], maxX[i], maxY[i], x, y, radius))
+				masks[i / 32] |= 1u << (i % 32);
+	}
+
+	// the same for boxes intersecting the AABB, matching AABB::intersectsAABB
+	static void aabbMask(const int* minX, const int* minY, const int* maxX, const int* maxY,
+											 const size_t count, const AABB& aabb, uint32_t* masks) {
+		std::fill(masks, masks + (count + 31) / 32, 0u);
+		const int x0 = aabb.getX(), y0 = aabb.getY(),
+							x1 = x0 + aabb.getWidth(), y1 = y0 + aabb.getHeight();
+		size_t i = 0;
+#if defined(BROADPHASE_AVX2)
+		const __m256i vx0 = _mm256_set1_epi32(x0), vy0 = _mm256_set1_epi32(y0),
+				vx1 = _mm256_set1_epi32(x1), vy1 = _mm256_set1_epi32(y1);
+		for (; i + 8 <= count; i += 8) {
+			// a miss is any box entirely to one side
+			const __m256i miss = _mm256_or_si256(
+					_mm256_or_si256(_mm256_cmpgt_epi32(vx0, _mm256_loadu_si256((const __m256i*) (maxX + i))),
+													_mm256_cmpgt_epi32(_mm256_loadu_si256((const __m256i*) (minX + i)), vx1)),
+					_mm256_or_si256(_mm256_cmpgt_epi32(vy0, _mm256_loadu_si256((const __m256i*) (maxY + i))),
+													_mm256_cmpgt_epi32(_mm256_loadu_si256((const __m256i*) (minY + i)), vy1)));
+			const uint32_t bits = (uint32_t) _mm256_movemask_ps(_mm256_castsi256_ps(miss));
+			masks[i / 32] |= (~bits & 0xFFu) << (i % 32);
+		}
+#elif defined(BROADPHASE_SSE4)
+		const __m128i vx0 = _mm_set1_epi32(x0), vy0 = _mm_set1_epi32(y0),
+				vx1 = _mm_set1_epi32(x1), vy1 = _mm_set1_epi32(y1);
+		for (; i + 4 <= count; i += 4) {
+			const __m128i miss = _mm_or_si128(
+					_mm_or_si128(_mm_cmpgt_epi32(vx0, _mm_loadu_si128((const __m128i*) (maxX + i))),
+											 _mm_cmpgt_epi32(_mm_loadu_si128((const __m128i*) (minX + i)), vx1)),
+					_mm_or_si128(_mm_cmpgt_epi32(vy0, _mm_loadu_si128((const __m128i*) (maxY + i))),
+											 _mm_cmpgt_epi32(_mm_loadu_si128((const __m128i*) (minY + i)), vy1)));
+			const uint32_t bits = (uint32_t) _mm_movemask_ps(_mm_castsi128_ps(miss));
+			masks[i / 32] |= (~bits & 0xFu) << (i % 32);
+		}
+#endif
+		for (; i < count; ++i)
+			if (aabbTest(minX[i], minY[i], maxX[i], maxY[i], x0, y0, x1, y1))
+				masks[i / 32] |= 1u << (i % 32);
+	}
+
+	/**
+	 * Calls visit(i) for every entry in [first, last) whose box intersects the circle, stopping and
+	 * returning false as soon as the visitor does.
+	 */
+	template<typename Visitor>
+	bool forEachCircleHit(const size_t first, const size_t last,
+												const int x, const int y, const int radius, Visitor&& visit) const {
+		uint32_t masks[chunk / 32];
+		for (size_t base = first; base < last; base += chunk) {
+			const size_t n = std::min<size_t>(chunk, last - base);
+			BROADPHASE_COUNT(tests, n);
+			circleMask(minX() + base, minY() + base, maxX() + base, maxY() + base, n, x, y, radius, masks);
+			if (!visitMasks(masks, base, n, visit)) return false;
+		}
+		return true;
+	}
+
+	// the same for every entry whose box intersects the AABB
+	template<typename Visitor>
+	bool forEachAABBHit(const size_t first, const size_t last, const AABB& aabb, Visitor&& visit) const {
+		uint32_t masks[chunk / 32];
+		for (size_t base = first; base < last; base += chunk) {
+			const size_t n = std::min<size_t>(chunk, last - base);
+			BROADPHASE_COUNT(tests, n);
+			aabbMask(minX() + base, minY() + base, maxX() + base, maxY() + base, n, aabb, masks);
+			if (!visitMasks(masks, base, n, visit)) return false;
+		}
+		return true;
+	}
+
+private:
+	// the position of the lowest set bit of a nonzero mask
+	static int lowestBit(const uint32_t bits) {
+#if defined(__GNUC__)
+		return __builtin_ctz(bits);
+#elif defined(_MSC_VER)
+		unsigned long bit;
+		_BitScanForward(&bit, bits);
+		return (int) bit;
+#else
+		int bit = 0;
+		while (!(bits & (1u << bit))) ++bit;
+		return bit;
+#endif
+	}
+
+	template<typename Visitor>
+	static bool visitMasks(const uint32_t* masks, const size_t base, const size_t n, Visitor& visit) {
+		for (size_t word = 0; word < (n + 31) / 32; ++word) {
+			for (uint32_t bits = masks[word]; bits; bits &= bits - 1) {
+				BROADPHASE_COUNT(hits, 1);
+				if (!visit(base + word * 32 + lowestBit(bits))) return false;
+			}
+		}
+		return true;
+	}
+};
+
+#endif // PROXYBATCH_HPP
@@ -11,56 +11,421 @@
 
 #include "Broadphase.hpp"
 
+#include <algorithm>
+#include <climits>
+#include <cstdint>
+#include <atomic>
+#include <functional>
+#include <mutex>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
 /*
- * Prune Sweep Sucks
- *
- * I spent some time fiddling with this algorithm before I realized its absolutely pointless nature
- * akin to that of the kd tree or any of the other dynamic tree solutions to the problem of broadphase.
- * Starting out with the use of a vector, your update complexity can not beat O(n log n) as it
- * essentially has to resort the proxies. The time could be improved using a linked list allowing
- * constant insertion and removal to move the proxies in the list during sort, but then binary search
- * becomes impossible and degenerates to O(n). A skip list is thus the next logical step but is the
- * same as a binary space partition at that point, which I also ruled out as useless due to its
- * similarity to the quadtree!
+ * Incremental Sweep and Prune
  *
- * Summary: Prune Sweep -> A poor man's binary space partition. Consider this class simply the base time
- * for comparison in the benchmark table.
+ * Each axis keeps a sorted array of box endpoints bracketed by two sentinels. Moving a proxy rewrites
+ * its four endpoint values and insertion sorts them back into place, which for slow moving objects is
+ * only a handful of swaps since the arrays are already nearly sorted from the previous frame. Whenever
+ * a min endpoint passes a max endpoint the two boxes may have started overlapping, and whenever a max
+ * passes a min they have certainly separated, so the overlapping pair set is maintained during the
+ * swaps themselves rather than recomputed. Updates cost O(n + swaps) instead of a remove and add.
  *
+ * Added boxes wait at the end of the box list and removed ones are only marked dead, so filling or
+ * emptying the world does not sort every box across every endpoint. The next update or query merges
+ * the sorted endpoints of the new boxes in one pass and finds their pairs by probing the x axis like
+ * a query. A removal drops its pairs the same way right away, while its endpoints stay in place and
+ * are skipped until a quarter of the boxes are dead and the next merge compacts them.
  */
 
 class PruneSweep : public Broadphase {
+	struct ProxyPairHash {
+		inline std::size_t operator()(const ProxyPair &v) const {
+			uint64_t h = (uint64_t)(uintptr_t) v.first * 0x9E3779B97F4A7C15ULL;
+			h ^= (uint64_t)(uintptr_t) v.second + 0x7F4A7C159E3779B9ULL + (h << 6) + (h >> 2);
+			return (std::size_t) (h ^ (h >> 29));
+		}
+	};
+
+	struct Endpoint {
+		int value;
+		int box;
+		bool max;
+	};
+
+	struct Box {
+		Proxy* proxy;
+		int min[2], max[2]; // endpoint indices per axis
+		int lower[2], upper[2]; // endpoint values per axis
+	};
+
+	// merged into the endpoints by whichever update or query first finds boxes pending
+	mutable std::vector<Endpoint> endpoints[2];
+	mutable std::vector<Box> boxes;
+	mutable std::unordered_set<ProxyPair, ProxyPairHash> pairs;
+	mutable size_t merged = 0; // boxes from here on are not in the endpoints yet
+	mutable size_t dead = 0; // removed boxes still holding their slot, their proxy null
+	mutable std::vector<int> remap; // new index of each box while compacting
+	mutable std::vector<Endpoint> scratch; // merged endpoints before they are swapped in
+	mutable std::atomic<bool> pending;
+	mutable std::mutex mergeMutex;
+	int maxWidth = 0;
+
+	static bool less(const Endpoint& a, const Endpoint& b) {
+		// touching boxes overlap, so mins sort ahead of maxes with the same value
+		return a.value < b.value || (a.value == b.value && !a.max && b.max);
+	}
+
+	int& endpointIndex(const Endpoint& endpoint, const int axis) const {
+		Box& box = boxes[endpoint.box];
+		return endpoint.max ? box.max[axis] : box.min[axis];
+	}
+
+	bool overlaps(const int a, const int b) const {
+		const Box &boxA = boxes[a], &boxB = boxes[b];
+		return boxA.upper[0] >= boxB.lower[0] && boxB.upper[0] >= boxA.lower[0] &&
+				boxA.upper[1] >= boxB.lower[1] && boxB.upper[1] >= boxA.lower[1];
+	}
+
+	static ProxyPair makePair(Proxy* a, Proxy* b) {
+		return std::less<Proxy*>()(a, b) ? ProxyPair(a, b) : ProxyPair(b, a);
+	}
+
+	bool compacting() const {
+		return dead * 4 > boxes.size();
+	}
+
+	// dead boxes keep their endpoints until compacted, so the swaps pass over them without pairs
+	void addPair(const int a, const int b) {
+		if (boxes[a].proxy && boxes[b].proxy && overlaps(a, b))
+			pairs.insert(makePair(boxes[a].proxy, boxes[b].proxy));
+	}
+
+	void removePair(const int a, const int b) {
+		if (boxes[a].proxy && boxes[b].proxy)
+			pairs.erase(makePair(boxes[a].proxy, boxes[b].proxy));
+	}
+
+	void sortDown(const int axis, int i) {
+		auto& axisEndpoints = endpoints[axis];
+		const Endpoint endpoint = axisEndpoints[i];
+		while (less(endpoint, axisEndpoints[i - 1])) {
+			Endpoint& prev = axisEndpoints[i - 1];
+			if (!endpoint.max && prev.max) addPair(endpoint.box, prev.box);
+			else if (endpoint.max && !prev.max) removePair(endpoint.box, prev.box);
+			axisEndpoints[i] = prev;
+			++endpointIndex(prev, axis);
+			--i;
+		}
+		axisEndpoints[i] = endpoint;
+		endpointIndex(endpoint, axis) = i;
+	}
+
+	void sortUp(const int axis, int i) {
+		auto& axisEndpoints = endpoints[axis];
+		const Endpoint endpoint = axisEndpoints[i];
+		while (less(axisEndpoints[i + 1], endpoint)) {
+			Endpoint& next = axisEndpoints[i + 1];
+			if (endpoint.max && !next.max) addPair(endpoint.box, next.box);
+			else if (!endpoint.max && next.max) removePair(endpoint.box, next.box);
+			axisEndpoints[i] = next;
+			--endpointIndex(next, axis);
+			++i;
+		}
+		axisEndpoints[i] = endpoint;
+		endpointIndex(endpoint, axis) = i;
+	}
+
+	void sortEndpoint(const int axis, const int i, const int oldValue) {
+		if (endpoints[axis][i].value < oldValue) sortDown(axis, i);
+		else if (endpoints[axis][i].value > oldValue) sortUp(axis, i);
+	}
+
+	void moveBox(const int b, const int minX, const int minY, const int maxX, const int maxY) {
+		const int mins[2] = { minX, minY }, maxs[2] = { maxX, maxY };
+		int oldMins[2], oldMaxs[2];
+		// write every new value before sorting so overlap tests see the final bounds
+		for (int axis = 0; axis < 2; ++axis) {
+			Box& box = boxes[b];
+			oldMins[axis] = box.lower[axis];
+			oldMaxs[axis] = box.upper[axis];
+			endpoints[axis][box.min[axis]].value = box.lower[axis] = mins[axis];
+			endpoints[axis][box.max[axis]].value = box.upper[axis] = maxs[axis];
+		}
+		for (int axis = 0; axis < 2; ++axis) {
+			// sort the leading endpoint first so the box never blocks itself
+			if (mins[axis] > oldMins[axis]) {
+				sortEndpoint(axis, boxes[b].max[axis], oldMaxs[axis]);
+				sortEndpoint(axis, boxes[b].min[axis], oldMins[axis]);
+			} else {
+				sortEndpoint(axis, boxes[b].min[axis], oldMins[axis]);
+				sortEndpoint(axis, boxes[b].max[axis], oldMaxs[axis]);
+			}
+		}
+	}
+
+	// calls visit(other) for every live sorted box whose min lies in reach of box b on the x axis
+	template<typename Visitor>
+	void visitNear(const int b, Visitor&& visit) const {
+		const auto& axisEndpoints = endpoints[0];
+		const Endpoint first = {boxes[b].lower[0] - maxWidth, -1, false};
+		auto it = std::lower_bound(axisEndpoints.begin(), axisEndpoints.end(), first, less);
+		for (; it->value <= boxes[b].upper[0] && it->box >= 0; ++it)
+			if (!it->max && it->box != b && boxes[it->box].proxy) visit(it->box);
+	}
+
+	// drops the dead boxes once there are enough, then merges the pending ones and finds their pairs
+	void merge() const {
+		if (compacting()) {
+			remap.assign(boxes.size(), -1);
+			size_t kept = 0, keptMerged = 0;
+			for (size_t b = 0; b < boxes.size(); ++b) {
+				if (!boxes[b].proxy) continue;
+				if (b < merged) ++keptMerged;
+				remap[b] = (int) kept;
+				boxes[b].proxy->index = (int) kept;
+				boxes[kept++] = boxes[b];
+			}
+			boxes.resize(kept);
+			merged = keptMerged;
+			for (int axis = 0; axis < 2; ++axis) {
+				auto& axisEndpoints = endpoints[axis];
+				size_t out = 0;
+				for (const Endpoint& endpoint : axisEndpoints) {
+					if (endpoint.box >= 0 && remap[endpoint.box] < 0) continue;
+					axisEndpoints[out] = endpoint;
+					if (endpoint.box >= 0) axisEndpoints[out].box = remap[endpoint.box];
+					++out;
+				}
+				axisEndpoints.resize(out);
+			}
+			dead = 0;
+		}
+		if (merged < boxes.size()) {
+			for (int axis = 0; axis < 2; ++axis) {
+				auto& axisEndpoints = endpoints[axis];
+				std::vector<Endpoint> added;
+				added.reserve((boxes.size() - merged) * 2);
+				for (size_t b = merged; b < boxes.size(); ++b) {
+					if (!boxes[b].proxy) continue;
+					added.push_back({boxes[b].lower[axis], (int) b, false});
+					added.push_back({boxes[b].upper[axis], (int) b, true});
+				}
+				std::sort(added.begin(), added.end(), less);
+				scratch.resize(axisEndpoints.size() + added.size());
+				std::merge(axisEndpoints.begin(), axisEndpoints.end(), added.begin(), added.end(),
+									 scratch.begin(), less);
+				axisEndpoints.swap(scratch);
+			}
+			// each pair between two new boxes is found from both, so only the later one keeps it
+			const size_t first = merged;
+			merged = boxes.size();
+			for (size_t b = first; b < boxes.size(); ++b)
+				if (boxes[b].proxy) visitNear((int) b, [&](const int other) {
+					if ((size_t) other >= first && (size_t) other < b) return;
+					if (overlaps((int) b, other)) pairs.insert(makePair(boxes[b].proxy, boxes[other].proxy));
+				});
+		}
+		for (int axis = 0; axis < 2; ++axis)
+			for (size_t i = 1; i + 1 < endpoints[axis].size(); ++i)
+				endpointIndex(endpoints[axis][i], axis) = (int) i;
+	}
+
+	// merges on this thread if boxes were added or enough were removed since the last merge
+	void flush() const {
+		if (!pending.load(std::memory_order_acquire)) return;
+		std::lock_guard<std::mutex> lock(mergeMutex);
+		if (!pending.load(std::memory_order_relaxed)) return;
+		merge();
+		pending.store(false, std::memory_order_release);
+	}
+
+	void moveBox(const int b, const AABB& aabb) {
+		maxWidth = std::max(maxWidth, aabb.getWidth());
+		moveBox(b, aabb.getX(), aabb.getY(),
+						aabb.getX() + aabb.getWidth(), aabb.getY() + aabb.getHeight());
+	}
+
+	void reset() {
+		for (int axis = 0; axis < 2; ++axis) {
+			endpoints[axis].clear();
+			endpoints[axis].push_back({INT_MIN, -1, false});
+			endpoints[axis].push_back({INT_MAX, -1, true});
+		}
+		boxes.clear();
+		pairs.clear();
+		merged = dead = 0;
+		pending.store(false, std::memory_order_relaxed);
+		maxWidth = 0;
+	}
 
 public:
-	PruneSweep() {};
+	PruneSweep() : pending(false) { reset(); }
+	~PruneSweep() { clear(); }
 
 	Proxy* addPoint(const int x, const int y, void *const userdata) {
-		return 0;
+		return addProxy(AABB(x, y, 1, 1), userdata);
 	}
 
+	using Broadphase::addProxy;
+
+protected:
 	Proxy* addRectangle(
 			const int x, const int y, const int width, const int height, Proxy* proxy) {
-		return 0;
+		proxy->aabb = AABB(x, y, width, height);
+		return addProxy(proxy);
 	}
 
 	Proxy* addProxy(Proxy* proxy) override {
-		return 0;
+		const AABB& aabb = proxy->aabb;
+		proxy->index = (int) boxes.size();
+		boxes.push_back({proxy, {-1, -1}, {-1, -1}, {aabb.getX(), aabb.getY()},
+										 {aabb.getX() + aabb.getWidth(), aabb.getY() + aabb.getHeight()}});
+		maxWidth = std::max(maxWidth, aabb.getWidth());
+		pending.store(true, std::memory_order_relaxed);
+		return proxy;
 	}
 
-	void removeProxy(Proxy* proxy, bool free) override {
+public:
+	void removeProxy(Proxy* proxy, bool free = true) override {
+		const int b = proxy->index;
+		// only sorted boxes have pairs, and those are exactly the live boxes it overlaps
+		if ((size_t) b < merged)
+			visitNear(b, [&](const int other) {
+				if (overlaps(b, other)) pairs.erase(makePair(proxy, boxes[other].proxy));
+			});
+		boxes[b].proxy = nullptr;
+		++dead;
+		if (compacting()) pending.store(true, std::memory_order_relaxed);
+		proxy->index = -1;
+		if (free) destroyProxy(proxy);
+	}
 
+	void updateProxy(Proxy* proxy, const AABB& aabb) override {
+		if (proxy->aabb == aabb) return;
+		proxy->aabb = aabb;
+		flush();
+		moveBox(proxy->index, aabb);
 	}
 
-	// TODO: throw out
-	virtual void updateProxy(Proxy* proxy, const AABB& aabb) override {}
+	// merges added boxes now instead of on the next update or query
+	void rebuild() {
+		flush();
+	}
 
-	std::vector<Proxy*> queryRange(const int x, const int y, const int radius) override {
-		std::vector<Proxy*> hits;
+	using Broadphase::queryRange;
 
-		return hits;
+	template<typename Visitor>
+	bool visitRange(const int x, const int y, const int radius, Visitor&& visit) const {
+		BROADPHASE_STATS_SCOPE();
+		flush();
+		const auto& axisEndpoints = endpoints[0];
+		// any box reaching the circle has its min within one max width of the left edge
+		const Endpoint first = {x - radius - maxWidth, -1, false};
+		auto it = std::lower_bound(axisEndpoints.begin(), axisEndpoints.end(), first, less);
+		for (; it->value <= x + radius && it->box >= 0; ++it) {
+			if (it->max) continue;
+			Proxy* proxy = boxes[it->box].proxy;
+			if (!proxy) continue;
+			BROADPHASE_COUNT(tests, 1);
+			if (!proxy->aabb.intersectsCircle(x, y, radius)) continue;
+			BROADPHASE_COUNT(hits, 1);
+			if (!visit(proxy)) return false;
+		}
+		return true;
 	}
 
-	void clear() override {
+	void queryRange(const int x, const int y, const int radius, std::vector<Proxy*>& hits) const override {
+		visitRange(x, y, radius, [&](Proxy* proxy) { hits.push_back(proxy); return true; });
+	}
+
+	bool queryRange(const int x, const int y, const int radius, QueryCallback callback, void* context) const override {
+		return visitRange(x, y, radius, [=](Proxy* proxy) { return callback(proxy, context); });
+	}
+
+	using Broadphase::queryAABB;
+
+	template<typename Visitor>
+	bool visitAABB(const AABB& aabb, Visitor&& visit) const {
+		BROADPHASE_STATS_SCOPE();
+		flush();
+		const auto& axisEndpoints = endpoints[0];
+		const Endpoint first = {aabb.getX() - maxWidth, -1, false};
+		auto it = std::lower_bound(axisEndpoints.begin(), axisEndpoints.end(), first, less);
+		for (; it->value <= aabb.getX() + aabb.getWidth() && it->box >= 0; ++it) {
+			if (it->max) continue;
+			Proxy* proxy = boxes[it->box].proxy;
+			if (!proxy) continue;
+			BROADPHASE_COUNT(tests, 1);
+			if (!proxy->aabb.intersectsAABB(aabb)) continue;
+			BROADPHASE_COUNT(hits, 1);
+			if (!visit(proxy)) return false;
+		}
+		return true;
+	}
+
+	void queryAABB(const AABB& aabb, std::vector<Proxy*>& hits) const override {
+		visitAABB(aabb, [&](Proxy* proxy) { hits.push_back(proxy); return true; });
+	}
 
+	bool queryAABB(const AABB& aabb, QueryCallback callback, void* context) const override {
+		return visitAABB(aabb, [=](Proxy* proxy) { return callback(proxy, context); });
+	}
+
+	using Broadphase::queryCollisionPairs;
+
+	// the pairs are maintained by every update, so this only walks the current set
+	template<typename Visitor>
+	bool visitPairs(Visitor&& visit) const {
+		BROADPHASE_STATS_SCOPE();
+		flush();
+		for (const auto& pair : pairs) {
+			BROADPHASE_COUNT(hits, 1);
+			if (!visit(pair.first, pair.second)) return false;
+		}
+		return true;
+	}
+
+	void queryCollisionPairs(std::vector<ProxyPair>& out) const override {
+		BROADPHASE_STATS_SCOPE();
+		flush();
+		BROADPHASE_COUNT(hits, pairs.size());
+		out.insert(out.end(), pairs.begin(), pairs.end());
+	}
+
+	bool queryCollisionPairs(PairCallback callback, void* context) const override {
+		return visitPairs([=](Proxy* a, Proxy* b) { return callback(a, b, context); });
+	}
+
+	const std::unordered_set<ProxyPair, ProxyPairHash>& getOverlappingPairs() const {
+		flush();
+		return pairs;
+	}
+
+	// appends the overlapping pairs as proxy ids, the index half of each proxy's handle
+	void getOverlappingPairs(std::vector<IdPair>& out) const {
+		flush();
+		out.reserve(out.size() + pairs.size());
+		for (const auto& pair : pairs)
+			out.emplace_back(pair.first->id, pair.second->id);
+	}
+
+#ifdef BROADPHASE_STATS
+	void measureMemory(size_t& used, size_t& reserved) const override {
+		Broadphase::measureMemory(used, reserved);
+		// each pair is a hash node holding the pair and a link, plus the bucket array
+		const size_t pairBytes = pairs.size() * (sizeof(ProxyPair) + sizeof(void*)) +
+														 pairs.bucket_count() * sizeof(void*);
+		used += (endpoints[0].size() + endpoints[1].size()) * sizeof(Endpoint) +
+						boxes.size() * sizeof(Box) + pairBytes;
+		reserved += (endpoints[0].capacity() + endpoints[1].capacity()) * sizeof(Endpoint) +
+								boxes.capacity() * sizeof(Box) + pairBytes;
+	}
+#endif
+
+	void clear() override {
+		reset();
+		releaseProxies();
 	}
 };
 
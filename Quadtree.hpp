@@ -10,113 +10,365 @@
 #define QUADTREE_HPP
 
 #include "Broadphase.hpp"
+#include "ProxyBatch.hpp"
 
-#include <unordered_set>
+#include <vector>
 
 class Quadtree : public Broadphase
 {
+	static const int nullNode = -1;
+
+	// children are the four consecutive nodes NW, NE, SW, SE starting at firstChild
+	enum { NW, NE, SW, SE };
+
 	struct Node {
-		AABB aabb;
-		Node *NW = nullptr, *NE = nullptr, *SE = nullptr, *SW = nullptr;
-		std::unordered_set<Proxy*> children;
-
-		Node(const AABB& aabb): aabb(aabb) {}
-		~Node() {
-			for (auto proxy : children)
-				delete proxy;
-			delete NW;
-			delete NE;
-			delete SE;
-			delete SW;
+		AABB aabb, bounds; // bounds are the loose extents proxies may occupy
+		int firstChild, level, count; // count covers the whole subtree
+		ProxyBatch proxies; // each proxy's index is its slot in here
+
+		bool isLeaf() const { return firstChild == nullNode; }
+	};
+
+	// nodes past nodeCount keep their proxy storage around for reuse after a clear
+	std::vector<Node> nodes;
+	std::vector<int> freeBlocks;
+	int nodeCount;
+	int maxDepth;
+	float looseness;
+	int splitThreshold, mergeThreshold;
+
+	static AABB loosen(const AABB& aabb, const float looseness) {
+		const int dx = (int) (aabb.getWidth() * (looseness - 1.0f) / 2),
+							dy = (int) (aabb.getHeight() * (looseness - 1.0f) / 2);
+		return AABB(aabb.getX() - dx, aabb.getY() - dy,
+								aabb.getWidth() + 2 * dx, aabb.getHeight() + 2 * dy);
+	}
+
+	void initNode(const int index, const AABB& aabb, const int level) {
+		Node& node = nodes[index];
+		node.aabb = aabb;
+		node.bounds = loosen(aabb, looseness);
+		node.firstChild = nullNode;
+		node.level = level;
+		node.count = 0;
+		node.proxies.clear();
+	}
+
+	int allocateBlock() {
+		if (!freeBlocks.empty()) {
+			const int block = freeBlocks.back();
+			freeBlocks.pop_back();
+			return block;
 		}
+		const int block = nodeCount;
+		nodeCount += 4;
+		if ((int) nodes.size() < nodeCount) nodes.resize(nodeCount);
+		return block;
+	}
 
-		Proxy* addProxy(Proxy *proxy) {
-			if (!aabb.intersectsAABB(proxy->aabb)) return nullptr;
-			if (NW) {
-				if (NW->aabb.containsAABB(proxy->aabb)) return NW->addProxy(proxy);
-				if (NE->aabb.containsAABB(proxy->aabb)) return NE->addProxy(proxy);
-				if (SW->aabb.containsAABB(proxy->aabb)) return SW->addProxy(proxy);
-				if (SE->aabb.containsAABB(proxy->aabb)) return SE->addProxy(proxy);
-			}
-			children.insert(proxy);
-			return proxy;
+	void insert(const int index, Proxy* proxy) {
+		auto& proxies = nodes[index].proxies;
+		proxy->index = (int) proxies.size();
+		proxies.push_back(proxy);
+	}
+
+	void erase(const int index, Proxy* proxy) {
+		auto& proxies = nodes[index].proxies;
+		Proxy* last = proxies.back();
+		proxies.set(proxy->index, last);
+		last->index = proxy->index;
+		proxies.pop_back();
+	}
+
+	bool contains(const int index, const Proxy* proxy) const {
+		const auto& proxies = nodes[index].proxies;
+		return proxy->index >= 0 && proxy->index < (int) proxies.size() && proxies[proxy->index] == proxy;
+	}
+
+	// the child a proxy belongs in, or null when it has to stay at this node
+	int childFor(const int index, const AABB& box) const {
+		const Node& node = nodes[index];
+		if (node.isLeaf()) return nullNode;
+		if (looseness > 1.0f) {
+			// loose children are picked by center and only need to fit their enlarged bounds
+			const bool east = box.getX() + box.getWidth() / 2 >= nodes[node.firstChild + NE].aabb.getX(),
+								 south = box.getY() + box.getHeight() / 2 >= nodes[node.firstChild + SW].aabb.getY();
+			const int child = node.firstChild + (south ? (east ? SE : SW) : (east ? NE : NW));
+			return nodes[child].bounds.containsAABB(box) ? child : nullNode;
 		}
+		for (int child = node.firstChild; child < node.firstChild + 4; ++child)
+			if (nodes[child].aabb.containsAABB(box)) return child;
+		return nullNode;
+	}
+
+	void split(const int index) {
+		const int block = allocateBlock();
+		const AABB aabb = nodes[index].aabb;
+		const int newWidth = aabb.getWidth() / 2,
+							newHeight = aabb.getHeight() / 2,
+							level = nodes[index].level + 1;
+		initNode(block + NW, AABB(aabb.getX(), aabb.getY(), newWidth, newHeight), level);
+		initNode(block + NE, AABB(aabb.getX() + newWidth + 1, aabb.getY(), newWidth, newHeight), level);
+		initNode(block + SW, AABB(aabb.getX(), aabb.getY() + newHeight + 1, newWidth, newHeight), level);
+		initNode(block + SE, AABB(aabb.getX() + newWidth + 1, aabb.getY() + newHeight + 1, newWidth, newHeight), level);
+		nodes[index].firstChild = block;
 
-		void removeProxy(Proxy* proxy) {
-			if (!aabb.intersectsAABB(proxy->aabb)) return;
-			if (children.erase(proxy) > 0) return;
-			if (NW) {
-				NW->removeProxy(proxy);
-				NE->removeProxy(proxy);
-				SW->removeProxy(proxy);
-				SE->removeProxy(proxy);
+		auto& proxies = nodes[index].proxies;
+		for (size_t i = 0; i < proxies.size();) {
+			Proxy* proxy = proxies[i];
+			const int child = childFor(index, proxy->aabb);
+			if (child == nullNode) {
+				++i;
+				continue;
 			}
+			erase(index, proxy);
+			insert(child, proxy);
+			++nodes[child].count;
 		}
+	}
 
-		void clear() {
-			for (auto proxy : children)
-				delete proxy;
-			std::unordered_set<Proxy*>().swap(children);
-			if (NW) {
-				NW->clear();
-				NE->clear();
-				SW->clear();
-				SE->clear();
-			}
+	void collect(const int index, const int into) {
+		Node& node = nodes[index];
+		if (index != into) {
+			for (auto proxy : node.proxies)
+				insert(into, proxy);
+			node.proxies.clear();
 		}
+		if (node.isLeaf()) return;
+		for (int child = node.firstChild; child < node.firstChild + 4; ++child)
+			collect(child, into);
+		freeBlocks.push_back(node.firstChild);
+		node.firstChild = nullNode;
+	}
 
-		void queryRange(const int x, const int y, const int radius, std::vector<Proxy*>& hits) {
-			if (!aabb.intersectsCircle(x, y, radius)) return;
-			for (auto child : children)
-				if (child->aabb.intersectsCircle(x, y, radius))
-					hits.push_back(child);
-			if (NW) {
-				NW->queryRange(x, y, radius, hits);
-				NE->queryRange(x, y, radius, hits);
-				SW->queryRange(x, y, radius, hits);
-				SE->queryRange(x, y, radius, hits);
-			}
+	Proxy* addProxy(const int index, Proxy* proxy) {
+		if (!nodes[index].bounds.intersectsAABB(proxy->aabb)) return nullptr;
+		++nodes[index].count;
+		const int child = childFor(index, proxy->aabb);
+		if (child != nullNode) return addProxy(child, proxy);
+		insert(index, proxy);
+		const Node& node = nodes[index];
+		if (node.isLeaf() && (int) node.proxies.size() > splitThreshold && node.level < maxDepth)
+			split(index);
+		return proxy;
+	}
+
+	bool removeProxy(const int index, Proxy* proxy) {
+		if (!nodes[index].bounds.intersectsAABB(proxy->aabb)) return false;
+		if (contains(index, proxy)) {
+			erase(index, proxy);
+		} else {
+			const int child = childFor(index, proxy->aabb);
+			if (child == nullNode || !removeProxy(child, proxy)) return false;
 		}
-	};
+		// merging well below the split threshold keeps a node from thrashing every frame
+		if (--nodes[index].count < mergeThreshold && !nodes[index].isLeaf())
+			collect(index, index);
+		return true;
+	}
+
+	template<typename Visitor>
+	bool visitRange(const int index, const int x, const int y, const int radius, Visitor& visit) const {
+		const Node& node = nodes[index];
+		BROADPHASE_COUNT(nodes, 1);
+		if (!node.bounds.intersectsCircle(x, y, radius)) return true;
+		BROADPHASE_OCCUPANCY(node.proxies.size());
+		const bool more = node.proxies.forEachCircleHit(0, node.proxies.size(), x, y, radius, [&](const size_t i) {
+			return visit(node.proxies[i]);
+		});
+		if (!more) return false;
+		if (node.isLeaf()) return true;
+		for (int child = node.firstChild; child < node.firstChild + 4; ++child)
+			if (!visitRange(child, x, y, radius, visit)) return false;
+		return true;
+	}
 
-	Node root;
-	int depth;
+	template<typename Visitor>
+	bool visitAABB(const int index, const AABB& aabb, Visitor& visit) const {
+		const Node& node = nodes[index];
+		BROADPHASE_COUNT(nodes, 1);
+		if (!node.bounds.intersectsAABB(aabb)) return true;
+		BROADPHASE_OCCUPANCY(node.proxies.size());
+		const bool more = node.proxies.forEachAABBHit(0, node.proxies.size(), aabb, [&](const size_t i) {
+			return visit(node.proxies[i]);
+		});
+		if (!more) return false;
+		if (node.isLeaf()) return true;
+		for (int child = node.firstChild; child < node.firstChild + 4; ++child)
+			if (!visitAABB(child, aabb, visit)) return false;
+		return true;
+	}
+
+	// pairs between one proxy and everything in a subtree it is not part of
+	template<typename Visitor>
+	bool visitPairs(Proxy* proxy, const int index, Visitor& visit) const {
+		const Node& node = nodes[index];
+		BROADPHASE_COUNT(nodes, 1);
+		if (!node.bounds.intersectsAABB(proxy->aabb)) return true;
+		const bool more = node.proxies.forEachAABBHit(0, node.proxies.size(), proxy->aabb, [&](const size_t i) {
+			return visit(proxy, node.proxies[i]);
+		});
+		if (!more) return false;
+		if (node.isLeaf()) return true;
+		for (int child = node.firstChild; child < node.firstChild + 4; ++child)
+			if (!visitPairs(proxy, child, visit)) return false;
+		return true;
+	}
 
-	void buildTree(Node* root, int cd = 0) {
-		if (cd >= depth) return;
-		int newWidth = root->aabb.getWidth() / 2,
-				newHeight = root->aabb.getHeight() / 2;
-		root->NW = new Node(AABB(root->aabb.getX(), root->aabb.getY(), newWidth, newHeight));
-		root->NE = new Node(AABB(root->aabb.getX() + newWidth + 1, root->aabb.getY(), newWidth, newHeight));
-		root->SW = new Node(AABB(root->aabb.getX(), root->aabb.getY() + newHeight + 1, newWidth, newHeight));
-		root->SE = new Node(AABB(root->aabb.getX() + newWidth + 1, root->aabb.getY() + newHeight + 1, newWidth, newHeight));
-		buildTree(root->NW, cd + 1);
-		buildTree(root->NE, cd + 1);
-		buildTree(root->SW, cd + 1);
-		buildTree(root->SE, cd + 1);
+	// pairs between two disjoint subtrees, which only loose siblings can produce
+	template<typename Visitor>
+	bool visitPairs(const int a, const int b, Visitor& visit) const {
+		const Node& node = nodes[a];
+		if (!node.bounds.intersectsAABB(nodes[b].bounds)) return true;
+		for (auto proxy : node.proxies)
+			if (!visitPairs(proxy, b, visit)) return false;
+		if (node.isLeaf()) return true;
+		for (int child = node.firstChild; child < node.firstChild + 4; ++child)
+			if (!visitPairs(child, b, visit)) return false;
+		return true;
+	}
+
+	// pairs within a subtree, each found once from the node the upper proxy of the pair lives in
+	template<typename Visitor>
+	bool visitPairs(const int index, Visitor& visit) const {
+		const Node& node = nodes[index];
+		const ProxyBatch& proxies = node.proxies;
+		BROADPHASE_COUNT(nodes, 1);
+		BROADPHASE_OCCUPANCY(proxies.size());
+		for (size_t i = 0; i + 1 < proxies.size(); ++i) {
+			Proxy* proxy = proxies[i];
+			const bool more = proxies.forEachAABBHit(i + 1, proxies.size(), proxy->aabb, [&](const size_t other) {
+				return visit(proxy, proxies[other]);
+			});
+			if (!more) return false;
+		}
+		if (node.isLeaf()) return true;
+		for (auto proxy : proxies)
+			for (int child = node.firstChild; child < node.firstChild + 4; ++child)
+				if (!visitPairs(proxy, child, visit)) return false;
+		for (int child = node.firstChild; child < node.firstChild + 4; ++child) {
+			if (!visitPairs(child, visit)) return false;
+			for (int other = child + 1; other < node.firstChild + 4; ++other)
+				if (!visitPairs(child, other, visit)) return false;
+		}
+		return true;
+	}
+
+	void queryStructure(const int index, StructureCallback callback, void* context) const {
+		const Node& node = nodes[index];
+		callback(node.aabb, node.proxies.size(), node.level, context);
+		if (node.isLeaf()) return;
+		for (int child = node.firstChild; child < node.firstChild + 4; ++child)
+			queryStructure(child, callback, context);
 	}
 
 public:
-	Quadtree(int width = 1024, int height = 1024, int depth = 4):
-		Broadphase(), root(AABB(width, height)), depth(depth) {
-		buildTree(&root);
+	/**
+	 * Nodes split once they hold more than splitThreshold proxies, down to maxDepth levels, and
+	 * merge back once their subtree drops below mergeThreshold, so only occupied space is refined.
+	 * A looseness above 1 enlarges every node's bounds by that factor and places proxies by their
+	 * center, so a proxy sits at the depth matching its size instead of sticking to whichever
+	 * ancestor it straddles a split line of. A looseness of 2 fits any proxy no larger than a node.
+	 */
+	Quadtree(int width = 1024, int height = 1024, int maxDepth = 8, float looseness = 1.0f,
+					 int splitThreshold = 16, int mergeThreshold = 8):
+		Broadphase(), nodes(1), nodeCount(1), maxDepth(maxDepth), looseness(looseness),
+		splitThreshold(splitThreshold), mergeThreshold(mergeThreshold) {
+		initNode(0, AABB(width, height), 0);
 	}
+	~Quadtree() { clear(); }
 
+	float getLooseness() const { return looseness; }
+	int getMaxDepth() const { return maxDepth; }
+	int getSplitThreshold() const { return splitThreshold; }
+	int getMergeThreshold() const { return mergeThreshold; }
+
+	using Broadphase::addProxy;
+
+protected:
 	Proxy* addProxy(Proxy* proxy) override {
-		return root.addProxy(proxy);
+		return addProxy(0, proxy);
 	}
 
+public:
 	void removeProxy(Proxy* proxy, bool free) override {
-		root.removeProxy(proxy);
-		if (free) delete proxy;
+		removeProxy(0, proxy);
+		proxy->index = -1;
+		if (free) destroyProxy(proxy);
 	}
 
-	void clear() override { root.clear(); }
+	// every node with the proxies stored at it, not counting its children's
+	void queryStructure(StructureCallback callback, void* context) const override {
+		queryStructure(0, callback, context);
+	}
+
+#ifdef BROADPHASE_STATS
+	void measureMemory(size_t& used, size_t& reserved) const override {
+		Broadphase::measureMemory(used, reserved);
+		used += nodeCount * sizeof(Node) + freeBlocks.size() * sizeof(int);
+		reserved += nodes.capacity() * sizeof(Node) + freeBlocks.capacity() * sizeof(int);
+		for (const auto& node : nodes) {
+			used += node.proxies.usedBytes();
+			reserved += node.proxies.reservedBytes();
+		}
+	}
+#endif
+
+	void clear() override {
+		for (int i = 0; i < nodeCount; ++i)
+			nodes[i].proxies.clear();
+		freeBlocks.clear();
+		nodeCount = 1;
+		initNode(0, nodes[0].aabb, 0);
+		releaseProxies();
+	}
+
+	using Broadphase::queryRange;
+
+	template<typename Visitor>
+	bool visitRange(const int x, const int y, const int radius, Visitor&& visit) const {
+		BROADPHASE_STATS_SCOPE();
+		return visitRange(0, x, y, radius, visit);
+	}
+
+	void queryRange(const int x, const int y, const int radius, std::vector<Proxy*>& hits) const override {
+		visitRange(x, y, radius, [&](Proxy* proxy) { hits.push_back(proxy); return true; });
+	}
+
+	bool queryRange(const int x, const int y, const int radius, QueryCallback callback, void* context) const override {
+		return visitRange(x, y, radius, [=](Proxy* proxy) { return callback(proxy, context); });
+	}
+
+	using Broadphase::queryAABB;
+
+	template<typename Visitor>
+	bool visitAABB(const AABB& aabb, Visitor&& visit) const {
+		BROADPHASE_STATS_SCOPE();
+		return visitAABB(0, aabb, visit);
+	}
+
+	void queryAABB(const AABB& aabb, std::vector<Proxy*>& hits) const override {
+		visitAABB(aabb, [&](Proxy* proxy) { hits.push_back(proxy); return true; });
+	}
+
+	bool queryAABB(const AABB& aabb, QueryCallback callback, void* context) const override {
+		return visitAABB(aabb, [=](Proxy* proxy) { return callback(proxy, context); });
+	}
+
+	using Broadphase::queryCollisionPairs;
+
+	template<typename Visitor>
+	bool visitPairs(Visitor&& visit) const {
+		BROADPHASE_STATS_SCOPE();
+		return visitPairs(0, visit);
+	}
+
+	void queryCollisionPairs(std::vector<ProxyPair>& pairs) const override {
+		visitPairs([&](Proxy* a, Proxy* b) { pairs.emplace_back(a, b); return true; });
+	}
 
-	std::vector<Proxy*> queryRange(const int x, const int y, const int radius) override {
-		std::vector<Broadphase::Proxy*> hits;
-		root.queryRange(x, y, radius, hits);
-		return hits;
+	bool queryCollisionPairs(PairCallback callback, void* context) const override {
+		return visitPairs([=](Proxy* a, Proxy* b) { return callback(a, b, context); });
 	}
 };
 
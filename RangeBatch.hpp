@@ -0,0 +1,115 @@
+/**
+ * @file RangeBatch.hpp
+ * @brief Implements a batch of range queries answered in parallel into one flat result buffer.
+ * @section License
+ * Copyright (C) 2020 Robert Colton
+ * License pending. All rights reserved.
+ */
+
+#ifndef RANGEBATCH_HPP
+#define RANGEBATCH_HPP
+
+#include "Broadphase.hpp"
+#include "ThreadPool.hpp"
+
+#include <algorithm>
+#include <vector>
+
+/*
+ * Range queries only read the broadphase, so a batch of them can be spread over a thread pool as
+ * long as nothing is added, removed or updated until run() returns. Results come back in compressed
+ * row form: the hits of query i are stored contiguously from offset i up to offset i + 1 in a single
+ * hits array, in the same order a serial run would produce. Workers fill their own buffers while
+ * stealing chunks of queries from each other and the buffers are then copied into place, and all of
+ * the storage is kept between runs, so a warmed up batch queries without allocating.
+ */
+
+class RangeBatch {
+	typedef Broadphase::Proxy Proxy;
+
+public:
+	struct Query {
+		int x, y, radius;
+	};
+
+private:
+	// a run of queries answered by one worker and where its hits start in that worker's buffer
+	struct Chunk {
+		size_t first, last, start;
+	};
+
+	struct Worker {
+		std::vector<Proxy*> hits;
+		std::vector<Chunk> chunks;
+	};
+
+	std::vector<Query> queries;
+	std::vector<size_t> offsets;
+	std::vector<Proxy*> hits;
+	std::vector<Worker> workers;
+
+public:
+	void clear() {
+		queries.clear();
+		offsets.clear();
+		hits.clear();
+	}
+
+	void addQuery(const int x, const int y, const int radius) {
+		queries.push_back(Query{x, y, radius});
+	}
+
+	size_t size() const { return queries.size(); }
+	const Query& getQuery(const size_t i) const { return queries[i]; }
+
+	/**
+	 * Answers every query against the index, which may be any broadphase. Passing the concrete
+	 * backend type rather than a Broadphase reference lets its visitor traversal inline.
+	 */
+	template<typename Index>
+	void run(const Index& index, ThreadPool& threads, const size_t grain = 32) {
+		const size_t count = queries.size();
+		offsets.assign(count + 1, 0);
+		workers.resize(threads.size());
+		for (auto& worker : workers) {
+			worker.hits.clear();
+			worker.chunks.clear();
+		}
+
+		threads.parallelFor(count, grain, [&](const unsigned id, const size_t first, const size_t last) {
+			Worker& worker = workers[id];
+			worker.chunks.push_back(Chunk{first, last, worker.hits.size()});
+			for (size_t i = first; i < last; ++i) {
+				const Query& query = queries[i];
+				const size_t before = worker.hits.size();
+				index.visitRange(query.x, query.y, query.radius, [&](Proxy* proxy) {
+					worker.hits.push_back(proxy);
+					return true;
+				});
+				offsets[i + 1] = worker.hits.size() - before;
+			}
+		});
+
+		for (size_t i = 0; i < count; ++i)
+			offsets[i + 1] += offsets[i];
+		hits.resize(offsets[count]);
+		threads.run([&](const unsigned id) {
+			const Worker& worker = workers[id];
+			for (const auto& chunk : worker.chunks) {
+				const auto source = worker.hits.begin() + chunk.start;
+				std::copy(source, source + (offsets[chunk.last] - offsets[chunk.first]),
+									hits.begin() + offsets[chunk.first]);
+			}
+		});
+	}
+
+	size_t getHitCount(const size_t i) const { return offsets[i + 1] - offsets[i]; }
+	Proxy* const* beginHits(const size_t i) const { return hits.data() + offsets[i]; }
+	Proxy* const* endHits(const size_t i) const { return hits.data() + offsets[i + 1]; }
+
+	// the raw compressed rows, one more offset than there are queries
+	const std::vector<size_t>& getOffsets() const { return offsets; }
+	const std::vector<Proxy*>& getHits() const { return hits; }
+};
+
+#endif // RANGEBATCH_HPP
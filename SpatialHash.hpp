@@ -10,47 +10,152 @@
 #define SPATIALHASH_HPP
 
 #include "Broadphase.hpp"
+#include "CellTable.hpp"
+#include "ProxyBatch.hpp"
+#include "ThreadPool.hpp"
 
-#include <iterator>
-#include <unordered_map>
-#include <unordered_set>
 #include <vector>
 #include <algorithm>
 
-struct Point {
-	int x, y;
-	Point(int x, int y) : x(x), y(y) {}
+class SpatialHash : public Broadphase {
+	struct Cell {
+		uint64_t key;
+		size_t origins; // proxies [0, origins) start in this cell, the rest are foreign
+		ProxyBatch proxies;
+	};
+
+	// the cells a proxy covers and its slot in each of them, row by row
+	struct Record {
+		Proxy* proxy;
+		int x0, y0, x1, y1;
+		std::vector<uint32_t> slots;
 
-	friend inline bool operator==(Point const& lhs, Point const& rhs)
-	{
-		return (lhs.x == rhs.x) && (lhs.y == rhs.y);
+		bool covers(const int i, const int ii) const {
+			return i >= x0 && i <= x1 && ii >= y0 && ii <= y1;
+		}
+		uint32_t& slot(const int i, const int ii) {
+			return slots[(ii - y0) * (x1 - x0 + 1) + (i - x0)];
+		}
+	};
+
+	int cell_width, cell_height;
+	// cells are kept dense and the table maps packed cell coordinates to their slot
+	std::vector<Cell> cells;
+	CellTable table;
+	// proxy storage recycled from erased cells
+	std::vector<ProxyBatch> pool;
+	// indexed by each proxy's index, records past recordCount keep their slot storage for reuse
+	std::vector<Record> records;
+	size_t recordCount = 0;
+	std::vector<uint32_t> scratchSlots;
+
+	// floor division so negative coordinates get their own cells instead of sharing cell zero
+	static int cellIndex(const int v, const int size) {
+		return v >= 0 ? v / size : -((-v - 1) / size) - 1;
 	}
-};
 
-class SpatialHash : public Broadphase {
-	typedef std::pair<void *const, void *const> CollisionPair;
+	void cellRange(const AABB& aabb, int& x0, int& y0, int& x1, int& y1) const {
+		x0 = cellIndex(aabb.getX(), cell_width);
+		y0 = cellIndex(aabb.getY(), cell_height);
+		x1 = cellIndex(aabb.getX() + aabb.getWidth(), cell_width);
+		y1 = cellIndex(aabb.getY() + aabb.getHeight(), cell_height);
+	}
 
-	struct PointHash {
-		inline std::size_t operator()(const Point &v) const {
-			return v.x * 31 + v.y;
+	Cell& cellAt(const int i, const int ii) {
+		const uint64_t key = CellTable::pack(i, ii);
+		const uint32_t index = table.insert(key, (uint32_t) cells.size());
+		if (index == cells.size()) {
+			cells.push_back(Cell{key, 0, ProxyBatch()});
+			if (!pool.empty()) {
+				cells.back().proxies.swap(pool.back());
+				pool.pop_back();
+			}
 		}
-	};
+		return cells[index];
+	}
+
+	const Cell* findCell(const int i, const int ii) const {
+		const uint32_t index = table.find(CellTable::pack(i, ii));
+		return index == CellTable::npos ? nullptr : &cells[index];
+	}
 
-	struct CollisionPairHash {
-		inline std::size_t operator()(const CollisionPair &v) const {
-			uintptr_t ad = (uintptr_t) &v;
-			return (size_t) ((13*ad) ^ (ad >> 15));
+	void eraseCell(Cell& cell) {
+		const uint32_t index = (uint32_t) (&cell - cells.data());
+		table.erase(cell.key);
+		cell.proxies.clear();
+		pool.emplace_back();
+		pool.back().swap(cell.proxies);
+		if (index != cells.size() - 1) {
+			cell = std::move(cells.back());
+			table.assign(cell.key, index);
 		}
-	};
+		cells.pop_back();
+	}
 
-	int cell_width, cell_height;
-	using CellBucket = std::pair<std::vector<Proxy*>,std::vector<Proxy*>>;
-	std::unordered_map<Point, CellBucket, PointHash> cells;
+	void place(Cell& cell, const int i, const int ii, const uint32_t slot, Proxy* proxy) {
+		cell.proxies.set(slot, proxy);
+		records[proxy->index].slot(i, ii) = slot;
+	}
+
+	void swapSlots(Cell& cell, const int i, const int ii, const uint32_t a, const uint32_t b) {
+		if (a == b) return;
+		Proxy* proxy = cell.proxies[a];
+		place(cell, i, ii, a, cell.proxies[b]);
+		place(cell, i, ii, b, proxy);
+	}
+
+	void insertProxy(const int i, const int ii, Proxy* proxy, const bool origin) {
+		Cell& cell = cellAt(i, ii);
+		const uint32_t slot = (uint32_t) cell.proxies.size();
+		cell.proxies.push_back(proxy);
+		records[proxy->index].slot(i, ii) = slot;
+		if (origin) swapSlots(cell, i, ii, slot, (uint32_t) cell.origins++);
+	}
+
+	void eraseProxy(const int i, const int ii, Proxy* proxy, const bool origin) {
+		const uint32_t index = table.find(CellTable::pack(i, ii));
+		if (index == CellTable::npos) return;
+		Cell& cell = cells[index];
+		uint32_t slot = records[proxy->index].slot(i, ii);
+		if (origin) {
+			// fill the hole from the end of the origin run, then close the run up from the back
+			const uint32_t last = (uint32_t) --cell.origins;
+			if (slot != last) place(cell, i, ii, slot, cell.proxies[last]);
+			slot = last;
+		}
+		const uint32_t back = (uint32_t) cell.proxies.size() - 1;
+		if (slot != back) place(cell, i, ii, slot, cell.proxies[back]);
+		cell.proxies.pop_back();
+		// reclaim the bucket as soon as it empties so the table tracks live proxies only
+		if (cell.proxies.empty()) eraseCell(cell);
+	}
+
+	static uint64_t pairCost(const Cell& cell) {
+		const uint64_t count = cell.proxies.size();
+		return count * (count - 1) / 2 + 1;
+	}
+
+	// rewrites the bounds a proxy left in the cells of [x0, x1] x [y0, y1] after it moved
+	void refreshBounds(Proxy* proxy, const int x0, const int y0, const int x1, const int y1) {
+		Record& record = records[proxy->index];
+		for (int i = x0; i <= x1; ++i)
+			for (int ii = y0; ii <= y1; ++ii)
+				cells[table.find(CellTable::pack(i, ii))].proxies.refresh(record.slot(i, ii));
+	}
+
+	// moves a proxy across the origin boundary of a cell it stays in
+	void setOrigin(const int i, const int ii, Proxy* proxy, const bool origin) {
+		Cell& cell = cells[table.find(CellTable::pack(i, ii))];
+		const uint32_t slot = records[proxy->index].slot(i, ii);
+		if (origin) swapSlots(cell, i, ii, slot, (uint32_t) cell.origins++);
+		else swapSlots(cell, i, ii, slot, (uint32_t) --cell.origins);
+	}
 
 public:
 	SpatialHash() : cell_width(64), cell_height(64) {};
 	SpatialHash(int cell_width, int cell_height) :
 		cell_width(cell_width), cell_height(cell_height) {}
+	~SpatialHash() { clear(); }
 
 	void setCellSize(const int cell_width, const int cell_height) {
 		this->cell_width = cell_width;
@@ -73,21 +178,35 @@ public:
 		return cell_height;
 	}
 
+	/**
+	 * Only cells holding at least one proxy are kept, so this never exceeds the number of cells
+	 * covered by the live proxies no matter how many queries have been run.
+	 */
+	size_t getCellCount() const {
+		return cells.size();
+	}
+
 	Proxy* addPoint(const int x, const int y, void *const userdata) {
-		Proxy* proxy = new Proxy(AABB(x, y, 1, 1), userdata);
-		cells[Point(x / cell_width, y / cell_height)].first.push_back(proxy);
-		return proxy;
+		return addProxy(createProxy(AABB(x, y, 1, 1), userdata));
 	}
 
+	using Broadphase::addProxy;
+
+protected:
 	Proxy* addRectangle(
 			const int x, const int y, const int width, const int height, Proxy* proxy) {
-		int xx = x / cell_width, yy = y / cell_height;
-		for (int i = xx; i < ((x + width) / cell_width) + 1; ++i) {
-			for (int ii = yy; ii < ((y + height) / cell_height) + 1; ++ii) {
-				auto& cell = cells[Point(i, ii)];
+		proxy->aabb = AABB(x, y, width, height);
+		proxy->index = (int) recordCount++;
+		if (records.size() < recordCount) records.emplace_back();
+		Record& record = records[proxy->index];
+		record.proxy = proxy;
+		cellRange(proxy->aabb, record.x0, record.y0, record.x1, record.y1);
+		record.slots.resize((record.x1 - record.x0 + 1) * (record.y1 - record.y0 + 1));
+		const int xx = record.x0, yy = record.y0;
+		for (int i = xx; i <= record.x1; ++i) {
+			for (int ii = yy; ii <= record.y1; ++ii) {
 				const bool origin = (i == xx && ii == yy);
-				auto& cellProxies = origin ? cell.first : cell.second;
-				cellProxies.push_back(proxy);
+				insertProxy(i, ii, proxy, origin);
 			}
 		}
 		return proxy;
@@ -98,85 +217,273 @@ public:
 		return addRectangle(aabb.getX(), aabb.getY(), aabb.getWidth(), aabb.getHeight(), proxy);
 	}
 
+public:
 	void removeProxy(Proxy* proxy, bool free) {
-		int x = proxy->aabb.getX(), y = proxy->aabb.getY(),
-				width = proxy->aabb.getWidth(), height = proxy->aabb.getHeight();
-		int xx = x / cell_width, yy = y / cell_height;
-		for (int i = xx; i < ((x + width) / cell_width) + 1; ++i) {
-			for (int ii = yy; ii < ((y + height) / cell_height) + 1; ++ii) {
-				auto& cell = cells[Point(i, ii)];
-				const bool origin = (i == xx && ii == yy);
-				auto& cellProxies = origin ? cell.first : cell.second;
-				const auto it = std::find(cellProxies.begin(), cellProxies.end(), proxy);
-				cellProxies.erase(it);
-			}
+		const Record& record = records[proxy->index];
+		for (int i = record.x0; i <= record.x1; ++i)
+			for (int ii = record.y0; ii <= record.y1; ++ii)
+				eraseProxy(i, ii, proxy, i == record.x0 && ii == record.y0);
+
+		const int index = proxy->index;
+		if (index != (int) --recordCount) {
+			std::swap(records[index], records[recordCount]);
+			records[index].proxy->index = index;
 		}
-		if (free) delete proxy;
-	}
-
-	std::vector<Proxy*> queryRange(const int x, const int y, const int radius) {
-		std::vector<Proxy*> hits;
-		const int xx = (x - radius) / cell_width, yy = (y - radius) / cell_height;
-		for (int i = xx; i < ((x + radius) / cell_width) + 1; ++i) {
-			for (int ii = yy; ii < ((y + radius) / cell_height) + 1; ++ii) {
-				auto& cell = cells[Point(i, ii)];
-				for (auto proxy : cell.first) {
-					if (proxy->aabb.intersectsCircle(x, y, radius))
-						hits.push_back(proxy);
-				}
-				for (auto proxy : cell.second) {
-					auto px = proxy->aabb.getX() / cell_width,
-							 py = proxy->aabb.getY() / cell_height;
+		proxy->index = -1;
+		if (free) destroyProxy(proxy);
+	}
+
+	/**
+	 * Only the cells entering or leaving the proxy's covered range are restructured, so moving
+	 * within the same cells costs nothing beyond copying the new AABB into each cell's bounds.
+	 */
+	void updateProxy(Proxy* proxy, const AABB& aabb) override {
+		int x0, y0, x1, y1;
+		cellRange(aabb, x0, y0, x1, y1);
+		proxy->aabb = aabb;
+		Record& record = records[proxy->index];
+		if (x0 == record.x0 && y0 == record.y0 && x1 == record.x1 && y1 == record.y1) {
+			refreshBounds(proxy, x0, y0, x1, y1);
+			return;
+		}
+
+		const Record old = { nullptr, record.x0, record.y0, record.x1, record.y1, std::vector<uint32_t>() };
+		for (int i = old.x0; i <= old.x1; ++i)
+			for (int ii = old.y0; ii <= old.y1; ++ii)
+				if (!(i >= x0 && i <= x1 && ii >= y0 && ii <= y1))
+					eraseProxy(i, ii, proxy, i == old.x0 && ii == old.y0);
+
+		// carry the slots of the cells kept over into the new range
+		auto& slots = scratchSlots;
+		slots.resize((x1 - x0 + 1) * (y1 - y0 + 1));
+		for (int i = std::max(x0, old.x0); i <= std::min(x1, old.x1); ++i)
+			for (int ii = std::max(y0, old.y0); ii <= std::min(y1, old.y1); ++ii)
+				slots[(ii - y0) * (x1 - x0 + 1) + (i - x0)] = record.slot(i, ii);
+		record.x0 = x0;
+		record.y0 = y0;
+		record.x1 = x1;
+		record.y1 = y1;
+		record.slots.swap(slots);
+
+		if (record.covers(old.x0, old.y0) && (old.x0 != x0 || old.y0 != y0))
+			setOrigin(old.x0, old.y0, proxy, false);
+		if (old.covers(x0, y0) && (old.x0 != x0 || old.y0 != y0))
+			setOrigin(x0, y0, proxy, true);
+
+		refreshBounds(proxy, std::max(x0, old.x0), std::max(y0, old.y0),
+									std::min(x1, old.x1), std::min(y1, old.y1));
+		for (int i = x0; i <= x1; ++i)
+			for (int ii = y0; ii <= y1; ++ii)
+				if (!old.covers(i, ii))
+					insertProxy(i, ii, proxy, i == x0 && ii == y0);
+	}
+
+	using Broadphase::queryRange;
+
+	template<typename Visitor>
+	bool visitRange(const int x, const int y, const int radius, Visitor&& visit) const {
+		BROADPHASE_STATS_SCOPE();
+		const int xx = cellIndex(x - radius, cell_width), yy = cellIndex(y - radius, cell_height);
+		for (int i = xx; i < cellIndex(x + radius, cell_width) + 1; ++i) {
+			for (int ii = yy; ii < cellIndex(y + radius, cell_height) + 1; ++ii) {
+				const Cell* cell = findCell(i, ii);
+				BROADPHASE_COUNT(cells, 1);
+				if (!cell) continue;
+				const ProxyBatch& proxies = cell->proxies;
+				BROADPHASE_OCCUPANCY(proxies.size());
+				const bool more = proxies.forEachCircleHit(0, cell->origins, x, y, radius, [&](const size_t slot) {
+					return visit(proxies[slot]);
+				}) && proxies.forEachCircleHit(cell->origins, proxies.size(), x, y, radius, [&](const size_t slot) {
+					Proxy* proxy = proxies[slot];
+					auto px = cellIndex(proxy->aabb.getX(), cell_width),
+							 py = cellIndex(proxy->aabb.getY(), cell_height);
 					// already looked at this proxy?
-					if (std::max(px, xx) < i || std::max(py, yy) < ii) continue;
-					if (proxy->aabb.intersectsCircle(x, y, radius))
-						hits.push_back(proxy);
-				}
+					if (std::max(px, xx) < i || std::max(py, yy) < ii) {
+						BROADPHASE_COUNT(duplicates, 1);
+						return true;
+					}
+					return visit(proxy);
+				});
+				if (!more) return false;
 			}
 		}
-		return hits;
-	}
-
-	const std::unordered_set<CollisionPair, CollisionPairHash> queryCollisionPairs() {
-		std::unordered_set<CollisionPair, CollisionPairHash> collisionPairs;
-		for (const auto &cell : cells) {
-			const auto& origin = cell.second.first;
-			const auto& foreign = cell.second.second;
-
-			for (auto proxyIt = origin.cbegin(); proxyIt != origin.cend();) {
-				const auto &proxy = *proxyIt;
-				// compare to all other origin proxies
-				for (auto otherIt = ++proxyIt; otherIt != origin.cend(); ++otherIt) {
-					const auto &other = *otherIt;
-					if (proxy->aabb.intersectsAABB(other->aabb))
-						collisionPairs.insert(CollisionPair(proxy->userdata, other->userdata));
-				}
-				// compare to all foreign proxies
-				for (auto otherIt = foreign.cbegin(); otherIt != foreign.cend(); ++otherIt) {
-					const auto &other = *otherIt;
-					if (proxy->aabb.intersectsAABB(other->aabb))
-						collisionPairs.insert(CollisionPair(proxy->userdata, other->userdata));
-				}
+		return true;
+	}
+
+	void queryRange(const int x, const int y, const int radius, std::vector<Proxy*>& hits) const override {
+		visitRange(x, y, radius, [&](Proxy* proxy) { hits.push_back(proxy); return true; });
+	}
+
+	bool queryRange(const int x, const int y, const int radius, QueryCallback callback, void* context) const override {
+		return visitRange(x, y, radius, [=](Proxy* proxy) { return callback(proxy, context); });
+	}
+
+	using Broadphase::queryAABB;
+
+	template<typename Visitor>
+	bool visitAABB(const AABB& aabb, Visitor&& visit) const {
+		BROADPHASE_STATS_SCOPE();
+		int xx, yy, x1, y1;
+		cellRange(aabb, xx, yy, x1, y1);
+		for (int i = xx; i <= x1; ++i) {
+			for (int ii = yy; ii <= y1; ++ii) {
+				const Cell* cell = findCell(i, ii);
+				BROADPHASE_COUNT(cells, 1);
+				if (!cell) continue;
+				const ProxyBatch& proxies = cell->proxies;
+				BROADPHASE_OCCUPANCY(proxies.size());
+				const bool more = proxies.forEachAABBHit(0, cell->origins, aabb, [&](const size_t slot) {
+					return visit(proxies[slot]);
+				}) && proxies.forEachAABBHit(cell->origins, proxies.size(), aabb, [&](const size_t slot) {
+					// foreign proxies are reported from the first cell of the range they reach
+					const Record& record = records[proxies[slot]->index];
+					if (std::max(record.x0, xx) < i || std::max(record.y0, yy) < ii) {
+						BROADPHASE_COUNT(duplicates, 1);
+						return true;
+					}
+					return visit(proxies[slot]);
+				});
+				if (!more) return false;
 			}
+		}
+		return true;
+	}
+
+	void queryAABB(const AABB& aabb, std::vector<Proxy*>& hits) const override {
+		visitAABB(aabb, [&](Proxy* proxy) { hits.push_back(proxy); return true; });
+	}
+
+	bool queryAABB(const AABB& aabb, QueryCallback callback, void* context) const override {
+		return visitAABB(aabb, [=](Proxy* proxy) { return callback(proxy, context); });
+	}
+
+	using Broadphase::queryCollisionPairs;
+
+	/**
+	 * A pair of proxies spanning several cells meets in every cell their ranges share, so it is only
+	 * reported from the top left one of those, the owner cell at the larger of their first columns
+	 * and rows. Two proxies starting in the same cell always meet first in that cell.
+	 */
+	template<typename Visitor>
+	bool visitPairs(Visitor&& visit) const {
+		return visitPairs(0, cells.size(), visit);
+	}
 
-			// compare all foreign proxies to each other
-			for (auto proxyIt = foreign.cbegin(); proxyIt != foreign.cend();) {
-				const auto &proxy = *proxyIt;
-				for (auto otherIt = ++proxyIt; otherIt != foreign.cend(); ++otherIt) {
-					const auto &other = *otherIt;
-					if (proxy->aabb.intersectsAABB(other->aabb))
-						collisionPairs.insert(CollisionPair(proxy->userdata, other->userdata));
-				}
+	// the pairs owned by the dense cells in [first, last)
+	template<typename Visitor>
+	bool visitPairs(const size_t first, const size_t last, Visitor&& visit) const {
+		BROADPHASE_STATS_SCOPE();
+		for (size_t index = first; index < last; ++index) {
+			const Cell& cell = cells[index];
+			const int i = (int) (uint32_t) (cell.key >> 32), ii = (int) (uint32_t) cell.key;
+			const ProxyBatch& proxies = cell.proxies;
+			BROADPHASE_COUNT(cells, 1);
+			BROADPHASE_OCCUPANCY(proxies.size());
+			for (size_t slot = 0; slot + 1 < proxies.size(); ++slot) {
+				Proxy* proxy = proxies[slot];
+				const Record& record = records[proxy->index];
+				const bool more = proxies.forEachAABBHit(slot + 1, proxies.size(), proxy->aabb, [&](const size_t other) {
+					Proxy* hit = proxies[other];
+					if (other >= cell.origins) {
+						const Record& hitRecord = records[hit->index];
+						if (std::max(record.x0, hitRecord.x0) != i || std::max(record.y0, hitRecord.y0) != ii) {
+							BROADPHASE_COUNT(duplicates, 1);
+							return true;
+						}
+					}
+					return visit(proxy, hit);
+				});
+				if (!more) return false;
 			}
 		}
-		return collisionPairs;
+		return true;
+	}
+
+	void queryCollisionPairs(std::vector<ProxyPair>& pairs) const override {
+		visitPairs([&](Proxy* a, Proxy* b) { pairs.emplace_back(a, b); return true; });
 	}
 
+	bool queryCollisionPairs(PairCallback callback, void* context) const override {
+		return visitPairs([=](Proxy* a, Proxy* b) { return callback(a, b, context); });
+	}
+
+	/**
+	 * Splits the dense cells into one contiguous run per worker, balanced by the number of tests each
+	 * cell costs. Workers collect the pairs their cells own into their own buffers, which are then
+	 * copied out in worker order, so the result is the same as the serial query for any thread count.
+	 */
+	void queryCollisionPairs(std::vector<ProxyPair>& pairs, ThreadPool& threads) const {
+		const unsigned workers = threads.size();
+		uint64_t total = 0;
+		for (const auto& cell : cells)
+			total += pairCost(cell);
+		std::vector<size_t> runs(workers + 1, cells.size());
+		runs[0] = 0;
+		uint64_t sum = 0;
+		for (size_t index = 0, worker = 1; index < cells.size() && worker < workers; ++index) {
+			sum += pairCost(cells[index]);
+			while (worker < workers && sum * workers >= total * worker)
+				runs[worker++] = index + 1;
+		}
+
+		std::vector<std::vector<ProxyPair>> buffers(workers);
+		threads.run([&](const unsigned worker) {
+			auto& buffer = buffers[worker];
+			visitPairs(runs[worker], runs[worker + 1], [&](Proxy* a, Proxy* b) {
+				buffer.emplace_back(a, b);
+				return true;
+			});
+		});
+
+		std::vector<size_t> offsets(workers + 1, pairs.size());
+		for (unsigned worker = 0; worker < workers; ++worker)
+			offsets[worker + 1] = offsets[worker] + buffers[worker].size();
+		pairs.resize(offsets[workers]);
+		threads.run([&](const unsigned worker) {
+			std::copy(buffers[worker].begin(), buffers[worker].end(), pairs.begin() + offsets[worker]);
+		});
+	}
+
+	// every occupied cell with the number of proxies overlapping it
+	void queryStructure(StructureCallback callback, void* context) const override {
+		for (const auto& cell : cells) {
+			int i, ii;
+			CellTable::unpack(cell.key, i, ii);
+			callback(AABB(i * cell_width, ii * cell_height, cell_width, cell_height),
+							 cell.proxies.size(), 0, context);
+		}
+	}
+
+#ifdef BROADPHASE_STATS
+	void measureMemory(size_t& used, size_t& reserved) const override {
+		Broadphase::measureMemory(used, reserved);
+		used += cells.size() * sizeof(Cell) + table.usedBytes() + recordCount * sizeof(Record);
+		reserved += cells.capacity() * sizeof(Cell) + table.reservedBytes() +
+								records.capacity() * sizeof(Record) + pool.capacity() * sizeof(ProxyBatch) +
+								scratchSlots.capacity() * sizeof(uint32_t);
+		for (const auto& cell : cells) {
+			used += cell.proxies.usedBytes();
+			reserved += cell.proxies.reservedBytes();
+		}
+		for (const auto& batch : pool)
+			reserved += batch.reservedBytes();
+		for (size_t i = 0; i < records.size(); ++i) {
+			if (i < recordCount) used += records[i].slots.size() * sizeof(uint32_t);
+			reserved += records[i].slots.capacity() * sizeof(uint32_t);
+		}
+	}
+#endif
+
 	void clear() {
-		for (auto& cell : cells)
-			for (auto proxy : cell.second.first)
-				delete proxy;
-		std::unordered_map<Point, CellBucket, PointHash>().swap(cells);
+		recordCount = 0;
+		releaseProxies();
+		for (auto& cell : cells) {
+			cell.proxies.clear();
+			pool.emplace_back();
+			pool.back().swap(cell.proxies);
+		}
+		cells.clear();
+		table.clear();
 	}
 };
 
@@ -0,0 +1,135 @@
+/**
+ * @file ThreadPool.hpp
+ * @brief Implements a fixed pool of worker threads for splitting broadphase work.
+ * @section License
+ * Copyright (C) 2020 Robert Colton
+ * License pending. All rights reserved.
+ */
+
+#ifndef THREADPOOL_HPP
+#define THREADPOOL_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/*
+ * The workers are started once and sleep between jobs. A job runs once on every worker, with the
+ * calling thread taking part as worker 0, and run() returns when all of them have finished, so the
+ * job can freely capture the caller's locals. Jobs are not queued, only one runs at a time.
+ * parallelFor() deals a loop out evenly and lets workers that finish early steal the remaining
+ * chunks of the others, which keeps them busy when the cost per item is uneven.
+ */
+
+class ThreadPool {
+	typedef std::function<void(unsigned)> Job;
+
+	std::vector<std::thread> threads;
+	std::mutex mutex;
+	std::condition_variable wake, done;
+	const Job* job = nullptr;
+	uint64_t generation = 0;
+	size_t pending = 0;
+	bool stopping = false;
+
+	void work(const unsigned worker) {
+		uint64_t seen = 0;
+		for (;;) {
+			const Job* current;
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				wake.wait(lock, [&]() { return stopping || generation != seen; });
+				if (stopping) return;
+				seen = generation;
+				current = job;
+			}
+			(*current)(worker);
+			std::lock_guard<std::mutex> lock(mutex);
+			if (--pending == 0) done.notify_one();
+		}
+	}
+
+public:
+	// zero threads means one per hardware thread
+	explicit ThreadPool(unsigned threadCount = 0) {
+		if (!threadCount) threadCount = std::max(1u, std::thread::hardware_concurrency());
+		for (unsigned worker = 1; worker < threadCount; ++worker)
+			threads.emplace_back(&ThreadPool::work, this, worker);
+	}
+
+	~ThreadPool() {
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			stopping = true;
+		}
+		wake.notify_all();
+		for (auto& thread : threads)
+			thread.join();
+	}
+
+	ThreadPool(const ThreadPool&) = delete;
+	ThreadPool& operator=(const ThreadPool&) = delete;
+
+	// the number of workers, counting the calling thread
+	unsigned size() const { return (unsigned) threads.size() + 1; }
+
+	void run(const Job& task) {
+		if (threads.empty()) {
+			task(0);
+			return;
+		}
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			job = &task;
+			pending = threads.size();
+			++generation;
+		}
+		wake.notify_all();
+		task(0);
+		std::unique_lock<std::mutex> lock(mutex);
+		done.wait(lock, [&]() { return pending == 0; });
+	}
+
+	// calls task(worker, begin, end) on chunks of at most grain items until [0, count) is covered
+	template<typename Task>
+	void parallelFor(const size_t count, const size_t grain, Task&& task) {
+		// each worker's share, padded so owners and thieves do not contend over one cache line
+		struct Share {
+			std::atomic<size_t> next;
+			size_t end;
+			char padding[64 - sizeof(std::atomic<size_t>) - sizeof(size_t)];
+		};
+		const unsigned workers = size();
+		std::vector<Share> shares(workers);
+		for (unsigned worker = 0; worker < workers; ++worker) {
+			shares[worker].next.store(count * worker / workers, std::memory_order_relaxed);
+			shares[worker].end = count * (worker + 1) / workers;
+		}
+		const size_t step = std::max<size_t>(grain, 1);
+		run([&](const unsigned worker) {
+			// drain our own share first, then walk the others looking for leftovers
+			for (unsigned i = 0; i < workers; ++i) {
+				Share& share = shares[(worker + i) % workers];
+				for (size_t begin; (begin = share.next.fetch_add(step, std::memory_order_relaxed)) < share.end;)
+					task(worker, begin, std::min(begin + step, share.end));
+			}
+		});
+	}
+
+	// hands each worker one contiguous slice of [0, count), in worker order
+	template<typename Task>
+	void forEachRange(const size_t count, Task&& task) {
+		const size_t workers = size();
+		run([&](const unsigned worker) {
+			task(worker, count * worker / workers, count * (worker + 1) / workers);
+		});
+	}
+};
+
+#endif // THREADPOOL_HPP
@@ -0,0 +1,320 @@
+/**
+ * @file Trace.hpp
+ * @brief Implements recording broadphase operations to a compact binary trace and replaying them.
+ * @section License
+ * Copyright (C) 2020 Robert Colton
+ * License pending. All rights reserved.
+ */
+
+#ifndef TRACE_HPP
+#define TRACE_HPP
+
+#include "Broadphase.hpp"
+
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <iterator>
+#include <string>
+#include <vector>
+
+/*
+ * Trace Format
+ *
+ * A trace starts with the magic "BPTR" and a format version, followed by one record per operation:
+ * an opcode byte and its operands as zigzag encoded LEB128 varints. Proxies are named by the order
+ * they were added in, so an id is always below the number of adds before it, and an update stores
+ * how far each edge moved rather than the new box, so the common small move takes a handful of
+ * bytes. Frame records mark where each frame ends.
+ */
+
+struct Trace {
+	enum Op : uint8_t { Add, Update, Remove, Clear, QueryRange, QueryAABB, QueryPairs, Frame, OpCount };
+
+	static const char* getOpName(const Op op) {
+		static const char* const names[OpCount] = {
+			"add", "update", "remove", "clear", "range", "aabb", "pairs", "frame"
+		};
+		return names[op];
+	}
+
+	static void write(std::vector<uint8_t>& bytes, const int32_t value) {
+		uint32_t bits = ((uint32_t) value << 1) ^ (uint32_t) (value >> 31);
+		for (; bits >= 0x80; bits >>= 7)
+			bytes.push_back((uint8_t) (bits | 0x80));
+		bytes.push_back((uint8_t) bits);
+	}
+
+	// false at the end of the buffer or on an overlong varint
+	static bool read(const uint8_t*& at, const uint8_t* end, int32_t& value) {
+		uint32_t bits = 0;
+		for (int shift = 0; shift < 35; shift += 7) {
+			if (at == end) return false;
+			const uint8_t byte = *at++;
+			bits |= (uint32_t) (byte & 0x7F) << shift;
+			if (!(byte & 0x80)) {
+				value = (int32_t) (bits >> 1) ^ -(int32_t) (bits & 1);
+				return true;
+			}
+		}
+		return false;
+	}
+
+	enum { version = 2 };
+};
+
+/**
+ * Forwards operations to a broadphase and records them while recording is on. Like the PairManager
+ * the proxies are then added, moved and removed through the recorder instead of the broadphase.
+ */
+class TraceRecorder {
+	typedef Broadphase::Proxy Proxy;
+
+	Broadphase& broadphase;
+	std::vector<uint8_t> bytes;
+	std::vector<int32_t> traceIds; // trace id of each handle slot
+	int32_t adds = 0;
+	bool recording = false;
+
+	void record(const Trace::Op op) {
+		bytes.push_back(op);
+	}
+
+	void write(const int32_t value) {
+		Trace::write(bytes, value);
+	}
+
+	void write(const Proxy* proxy) {
+		write(traceIds[proxy->id]);
+	}
+
+	void recordAdd(const Proxy* proxy) {
+		if (traceIds.size() <= proxy->id) traceIds.resize(proxy->id + 1);
+		traceIds[proxy->id] = adds++;
+		record(Trace::Add);
+		write(proxy);
+		write(proxy->aabb);
+	}
+
+	void write(const AABB& aabb) {
+		write(aabb.getX());
+		write(aabb.getY());
+		write(aabb.getWidth());
+		write(aabb.getHeight());
+	}
+
+public:
+	explicit TraceRecorder(Broadphase& broadphase): broadphase(broadphase) {}
+
+	Broadphase& getBroadphase() const { return broadphase; }
+	bool isRecording() const { return recording; }
+	const std::vector<uint8_t>& getTrace() const { return bytes; }
+
+	// starts a new trace with the proxies already in the broadphase added first
+	void start() {
+		bytes.assign({ 'B', 'P', 'T', 'R' });
+		write(Trace::version);
+		recording = true;
+		adds = 0;
+		for (auto proxy : broadphase.getProxies())
+			recordAdd(proxy);
+	}
+
+	void stop() { recording = false; }
+
+	bool save(const std::string& path) const {
+		std::ofstream file(path, std::ios::binary);
+		file.write(reinterpret_cast<const char*>(bytes.data()), bytes.size());
+		return (bool) file;
+	}
+
+	Proxy* addProxy(const AABB& aabb, void* userdata = nullptr) {
+		Proxy* proxy = broadphase.addProxy(aabb, userdata);
+		if (proxy && recording) recordAdd(proxy);
+		return proxy;
+	}
+
+	void updateProxy(Proxy* proxy, const AABB& aabb) {
+		if (recording) {
+			record(Trace::Update);
+			write(proxy);
+			write(AABB(aabb.getX() - proxy->aabb.getX(), aabb.getY() - proxy->aabb.getY(),
+								 aabb.getWidth() - proxy->aabb.getWidth(), aabb.getHeight() - proxy->aabb.getHeight()));
+		}
+		broadphase.updateProxy(proxy, aabb);
+	}
+
+	void removeProxy(Proxy* proxy) {
+		if (recording) {
+			record(Trace::Remove);
+			write(proxy);
+		}
+		broadphase.removeProxy(proxy);
+	}
+
+	void clear() {
+		if (recording) record(Trace::Clear);
+		broadphase.clear();
+	}
+
+	template<typename Visitor>
+	bool visitRange(const int x, const int y, const int radius, Visitor&& visit) {
+		if (recording) {
+			record(Trace::QueryRange);
+			write(x);
+			write(y);
+			write(radius);
+		}
+		return broadphase.visitRange(x, y, radius, visit);
+	}
+
+	void queryRange(const int x, const int y, const int radius, std::vector<Proxy*>& hits) {
+		visitRange(x, y, radius, [&](Proxy* proxy) { hits.push_back(proxy); return true; });
+	}
+
+	template<typename Visitor>
+	bool visitAABB(const AABB& aabb, Visitor&& visit) {
+		if (recording) {
+			record(Trace::QueryAABB);
+			write(aabb);
+		}
+		return broadphase.visitAABB(aabb, visit);
+	}
+
+	void queryAABB(const AABB& aabb, std::vector<Proxy*>& hits) {
+		visitAABB(aabb, [&](Proxy* proxy) { hits.push_back(proxy); return true; });
+	}
+
+	void queryCollisionPairs(std::vector<Broadphase::ProxyPair>& pairs) {
+		if (recording) record(Trace::QueryPairs);
+		broadphase.queryCollisionPairs(pairs);
+	}
+
+	void endFrame() {
+		if (recording) record(Trace::Frame);
+	}
+};
+
+/**
+ * Runs a recorded trace against any broadphase, timing every operation and every frame. The hit
+ * count adds up all query results, so replays against different backends should agree on it.
+ */
+class TraceReplay {
+	typedef Broadphase::Proxy Proxy;
+
+	std::vector<uint8_t> bytes;
+
+public:
+	struct Result {
+		std::vector<double> times[Trace::OpCount]; // microseconds for each operation of each kind
+		std::vector<double> frames; // microseconds from the end of one frame to the end of the next
+		size_t hits = 0;
+	};
+
+	TraceReplay() {}
+	explicit TraceReplay(const std::vector<uint8_t>& bytes): bytes(bytes) {}
+
+	bool load(const std::string& path) {
+		std::ifstream file(path, std::ios::binary);
+		bytes.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+		return (bool) file || file.eof();
+	}
+
+	size_t size() const { return bytes.size(); }
+
+	// false if the trace is malformed, in which case the result covers what ran before that
+	bool replay(Broadphase& broadphase, Result& result) const {
+		typedef std::chrono::high_resolution_clock Clock;
+		const uint8_t* at = bytes.data();
+		const uint8_t* end = at + bytes.size();
+		int32_t version;
+		if (bytes.size() < 4 || std::string(at, at + 4) != "BPTR") return false;
+		at += 4;
+		if (!Trace::read(at, end, version) || version != Trace::version) return false;
+
+		std::vector<Proxy*> proxies; // indexed by recorded id
+		size_t adds = 0;
+		std::vector<Proxy*> hits;
+		std::vector<Broadphase::ProxyPair> pairs;
+		int32_t a[5];
+		auto operands = [&](const int count) {
+			for (int i = 0; i < count; ++i)
+				if (!Trace::read(at, end, a[i])) return false;
+			return true;
+		};
+		// ids count the adds, so one at or past the count names nothing and is malformed
+		auto proxy = [&](const int32_t id) -> Proxy*& {
+			if (proxies.size() <= (size_t) id) proxies.resize(adds, nullptr);
+			return proxies[id];
+		};
+
+		broadphase.clear();
+		auto frameStart = Clock::now();
+		while (at != end) {
+			const Trace::Op op = (Trace::Op) *at++;
+			const int count = op == Trace::Add || op == Trace::Update ? 5 : op == Trace::QueryAABB ? 4 :
+												op == Trace::QueryRange ? 3 : op == Trace::Remove ? 1 : 0;
+			if (op >= Trace::OpCount || !operands(count)) return false;
+			if (op == Trace::Add) ++adds;
+			if ((count == 5 || op == Trace::Remove) && (a[0] < 0 || (size_t) a[0] >= adds)) return false;
+
+			const auto start = Clock::now();
+			switch (op) {
+				case Trace::Add: {
+					// adding an id that is still live would lose the proxy it names
+					Proxy*& added = proxy(a[0]);
+					if (added) return false;
+					added = broadphase.addProxy(AABB(a[1], a[2], a[3], a[4]));
+					break;
+				}
+				case Trace::Update: {
+					// backends may refuse a proxy, then its later operations are skipped
+					Proxy* moved = proxy(a[0]);
+					if (!moved) continue;
+					const AABB& aabb = moved->aabb;
+					broadphase.updateProxy(moved, AABB(aabb.getX() + a[1], aabb.getY() + a[2],
+																						 aabb.getWidth() + a[3], aabb.getHeight() + a[4]));
+					break;
+				}
+				case Trace::Remove: {
+					Proxy*& removed = proxy(a[0]);
+					if (!removed) continue;
+					broadphase.removeProxy(removed);
+					removed = nullptr;
+					break;
+				}
+				case Trace::Clear:
+					broadphase.clear();
+					proxies.clear();
+					break;
+				case Trace::QueryRange:
+					hits.clear();
+					broadphase.queryRange(a[0], a[1], a[2], hits);
+					result.hits += hits.size();
+					break;
+				case Trace::QueryAABB:
+					hits.clear();
+					broadphase.queryAABB(AABB(a[0], a[1], a[2], a[3]), hits);
+					result.hits += hits.size();
+					break;
+				case Trace::QueryPairs:
+					pairs.clear();
+					broadphase.queryCollisionPairs(pairs);
+					result.hits += pairs.size();
+					break;
+				default:
+					break;
+			}
+			const auto finish = Clock::now();
+			if (op == Trace::Frame) {
+				result.frames.push_back(std::chrono::duration<double, std::micro>(finish - frameStart).count());
+				frameStart = finish;
+			} else {
+				result.times[op].push_back(std::chrono::duration<double, std::micro>(finish - start).count());
+			}
+		}
+		return true;
+	}
+};
+
+#endif // TRACE_HPP
@@ -0,0 +1,330 @@
+/**
+ * @file UniformGrid.hpp
+ * @brief Implements a dense uniform grid rebuilt from scratch by counting sort.
+ * @section License
+ * Copyright (C) 2020 Robert Colton
+ * License pending. All rights reserved.
+ */
+
+#ifndef UNIFORMGRID_HPP
+#define UNIFORMGRID_HPP
+
+#include "Broadphase.hpp"
+#include "ProxyBatch.hpp"
+#include "ThreadPool.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <functional>
+#include <mutex>
+#include <vector>
+
+/*
+ * Counting Sort Rebuild
+ *
+ * The grid covers a fixed world with one flat array of cells, and proxies outside the world fall
+ * into the border cells. Adding, moving and removing a proxy only marks the grid stale, and the
+ * next query or an explicit rebuild() sorts every proxy into the cells it covers from scratch: one
+ * pass counts the proxies per cell, a prefix sum turns the counts into each cell's start, and a
+ * second pass scatters the proxies into one buffer in cell order. Both passes can be split over
+ * a thread pool, each worker counting its slice of the proxies into its own histogram.
+ *
+ * The cells of a row are neighbours in the buffer, so a query filters one contiguous run per row.
+ * A proxy covering several cells is reported only from the first of them inside the query, the
+ * same rule the spatial hash uses.
+ */
+
+class UniformGrid : public Broadphase {
+	typedef std::function<void(unsigned, size_t, size_t)> SliceTask;
+
+	struct Span {
+		int x0, y0, x1, y1;
+	};
+
+	int width, height;
+	int cellWidth, cellHeight;
+	int columns, rows;
+	// indexed by each proxy's index
+	std::vector<Proxy*> members;
+
+	// the index, rebuilt by whichever query first finds it stale
+	mutable std::atomic<bool> stale;
+	mutable std::mutex buildMutex;
+	mutable std::vector<uint32_t> starts; // cell c holds entries [starts[c], starts[c + 1])
+	mutable ProxyBatch entries;
+	mutable std::vector<uint32_t> histograms; // a row of cell counts per worker
+	mutable std::vector<Span> spans; // indexed like members
+
+	// floor division clamped to the grid, so everything outside lands in a border cell
+	static int cellIndex(const int v, const int size, const int count) {
+		const int index = v >= 0 ? v / size : -((-v - 1) / size) - 1;
+		return std::max(0, std::min(count - 1, index));
+	}
+
+	int column(const int x) const { return cellIndex(x, cellWidth, columns); }
+	int row(const int y) const { return cellIndex(y, cellHeight, rows); }
+
+	Span span(const int x0, const int y0, const int x1, const int y1) const {
+		return Span{ column(x0), row(y0), column(x1), row(y1) };
+	}
+
+	Span span(const AABB& aabb) const {
+		return span(aabb.getX(), aabb.getY(), aabb.getX() + aabb.getWidth(), aabb.getY() + aabb.getHeight());
+	}
+
+	// runs the two counting passes with slices(task) covering every member once
+	void countingSort(const unsigned workers, const std::function<void(const SliceTask&)>& slices) const {
+		const size_t cellCount = starts.size() - 1;
+		histograms.assign(workers * cellCount, 0);
+		spans.resize(members.size());
+		slices([&](const unsigned worker, const size_t begin, const size_t end) {
+			uint32_t* counts = &histograms[worker * cellCount];
+			for (size_t i = begin; i < end; ++i) {
+				const Span s = spans[i] = span(members[i]->aabb);
+				for (int y = s.y0; y <= s.y1; ++y)
+					for (int x = s.x0; x <= s.x1; ++x)
+						++counts[y * columns + x];
+			}
+		});
+
+		// each worker's entries in a cell follow the previous worker's, keeping the serial order
+		uint32_t total = 0;
+		for (size_t cell = 0; cell < cellCount; ++cell) {
+			starts[cell] = total;
+			for (unsigned worker = 0; worker < workers; ++worker) {
+				uint32_t& count = histograms[worker * cellCount + cell];
+				const uint32_t cursor = total;
+				total += count;
+				count = cursor;
+			}
+		}
+		starts[cellCount] = total;
+		entries.resize(total);
+
+		slices([&](const unsigned worker, const size_t begin, const size_t end) {
+			uint32_t* cursors = &histograms[worker * cellCount];
+			for (size_t i = begin; i < end; ++i) {
+				const Span& s = spans[i];
+				for (int y = s.y0; y <= s.y1; ++y)
+					for (int x = s.x0; x <= s.x1; ++x)
+						entries.set(cursors[y * columns + x]++, members[i]);
+			}
+		});
+		stale.store(false, std::memory_order_release);
+	}
+
+	// sorts the proxies on this thread if anything changed since the last sort
+	void build() const {
+		if (!stale.load(std::memory_order_acquire)) return;
+		std::lock_guard<std::mutex> lock(buildMutex);
+		if (!stale.load(std::memory_order_relaxed)) return;
+		countingSort(1, [&](const SliceTask& task) { task(0, 0, members.size()); });
+	}
+
+	struct CircleFilter {
+		int x, y, radius;
+
+		template<typename Visitor>
+		bool operator()(const ProxyBatch& batch, const size_t first, const size_t last, Visitor&& visit) const {
+			return batch.forEachCircleHit(first, last, x, y, radius, visit);
+		}
+	};
+
+	struct AABBFilter {
+		const AABB& aabb;
+
+		template<typename Visitor>
+		bool operator()(const ProxyBatch& batch, const size_t first, const size_t last, Visitor&& visit) const {
+			return batch.forEachAABBHit(first, last, aabb, visit);
+		}
+	};
+
+	/**
+	 * Scans the cells of the query span a row at a time through the filter, keeping only the hits
+	 * found in the first cell of their own span that lies inside the query.
+	 */
+	template<typename Filter, typename Visitor>
+	bool visitCells(const Span& query, const Filter& filter, Visitor&& visit) const {
+		build();
+		const int* minX = entries.minX();
+		const int* minY = entries.minY();
+		for (int y = query.y0; y <= query.y1; ++y) {
+			const uint32_t* cells = &starts[y * columns];
+			BROADPHASE_COUNT(cells, query.x1 - query.x0 + 1);
+#ifdef BROADPHASE_STATS
+			for (int x = query.x0; x <= query.x1; ++x)
+				BROADPHASE_OCCUPANCY(cells[x + 1] - cells[x]);
+#endif
+			const bool more = filter(entries, cells[query.x0], cells[query.x1 + 1], [&](const size_t i) {
+				const int x = std::max(column(minX[i]), query.x0);
+				if (std::max(row(minY[i]), query.y0) != y || i < cells[x] || i >= cells[x + 1]) {
+					BROADPHASE_COUNT(duplicates, 1);
+					return true;
+				}
+				return visit(entries[i]);
+			});
+			if (!more) return false;
+		}
+		return true;
+	}
+
+public:
+	/**
+	 * Covers the world from (0, 0) to (width, height) with cells of the given size. Queries cost the
+	 * same anywhere, so the cells should be about the size of a typical proxy.
+	 */
+	UniformGrid(int width = 1024, int height = 1024, int cellWidth = 64, int cellHeight = 64):
+		Broadphase(), width(width), height(height), cellWidth(cellWidth), cellHeight(cellHeight),
+		columns(std::max(1, (width + cellWidth - 1) / cellWidth)),
+		rows(std::max(1, (height + cellHeight - 1) / cellHeight)),
+		stale(false), starts(columns * rows + 1, 0) {}
+	~UniformGrid() { clear(); }
+
+	int getWidth() const { return width; }
+	int getHeight() const { return height; }
+	int getCellWidth() const { return cellWidth; }
+	int getCellHeight() const { return cellHeight; }
+	size_t getCellCount() const { return starts.size() - 1; }
+
+	using Broadphase::addProxy;
+
+protected:
+	Proxy* addProxy(Proxy* proxy) override {
+		proxy->index = (int) members.size();
+		members.push_back(proxy);
+		stale.store(true, std::memory_order_relaxed);
+		return proxy;
+	}
+
+public:
+	void removeProxy(Proxy* proxy, bool free = true) override {
+		Proxy* last = members.back();
+		members[proxy->index] = last;
+		last->index = proxy->index;
+		members.pop_back();
+		proxy->index = -1;
+		stale.store(true, std::memory_order_relaxed);
+		if (free) destroyProxy(proxy);
+	}
+
+	void updateProxy(Proxy* proxy, const AABB& aabb) override {
+		if (proxy->aabb == aabb) return;
+		proxy->aabb = aabb;
+		stale.store(true, std::memory_order_relaxed);
+	}
+
+	// sorts the proxies into their cells now instead of on the next query
+	void rebuild() {
+		build();
+	}
+
+	// the same with both passes dealt out over the pool in contiguous slices of the proxies
+	void rebuild(ThreadPool& threads) {
+		std::lock_guard<std::mutex> lock(buildMutex);
+		if (!stale.load(std::memory_order_relaxed)) return;
+		countingSort(threads.size(), [&](const SliceTask& task) { threads.forEachRange(members.size(), task); });
+	}
+
+	bool isStale() const { return stale.load(std::memory_order_relaxed); }
+
+	// every cell with the number of proxies overlapping it
+	void queryStructure(StructureCallback callback, void* context) const override {
+		build();
+		for (int y = 0; y < rows; ++y)
+			for (int x = 0; x < columns; ++x) {
+				const size_t cell = y * columns + x;
+				callback(AABB(x * cellWidth, y * cellHeight, cellWidth, cellHeight),
+								 starts[cell + 1] - starts[cell], 0, context);
+			}
+	}
+
+#ifdef BROADPHASE_STATS
+	void measureMemory(size_t& used, size_t& reserved) const override {
+		Broadphase::measureMemory(used, reserved);
+		used += members.size() * sizeof(Proxy*) + starts.size() * sizeof(uint32_t) + entries.usedBytes();
+		reserved += members.capacity() * sizeof(Proxy*) + starts.capacity() * sizeof(uint32_t) +
+								entries.reservedBytes() + histograms.capacity() * sizeof(uint32_t) +
+								spans.capacity() * sizeof(Span);
+	}
+#endif
+
+	void clear() override {
+		members.clear();
+		entries.clear();
+		std::fill(starts.begin(), starts.end(), 0);
+		stale.store(false, std::memory_order_relaxed);
+		releaseProxies();
+	}
+
+	using Broadphase::queryRange;
+
+	template<typename Visitor>
+	bool visitRange(const int x, const int y, const int radius, Visitor&& visit) const {
+		BROADPHASE_STATS_SCOPE();
+		return visitCells(span(x - radius, y - radius, x + radius, y + radius), CircleFilter{ x, y, radius }, visit);
+	}
+
+	void queryRange(const int x, const int y, const int radius, std::vector<Proxy*>& hits) const override {
+		visitRange(x, y, radius, [&](Proxy* proxy) { hits.push_back(proxy); return true; });
+	}
+
+	bool queryRange(const int x, const int y, const int radius, QueryCallback callback, void* context) const override {
+		return visitRange(x, y, radius, [=](Proxy* proxy) { return callback(proxy, context); });
+	}
+
+	using Broadphase::queryAABB;
+
+	template<typename Visitor>
+	bool visitAABB(const AABB& aabb, Visitor&& visit) const {
+		BROADPHASE_STATS_SCOPE();
+		return visitCells(span(aabb), AABBFilter{ aabb }, visit);
+	}
+
+	void queryAABB(const AABB& aabb, std::vector<Proxy*>& hits) const override {
+		visitAABB(aabb, [&](Proxy* proxy) { hits.push_back(proxy); return true; });
+	}
+
+	bool queryAABB(const AABB& aabb, QueryCallback callback, void* context) const override {
+		return visitAABB(aabb, [=](Proxy* proxy) { return callback(proxy, context); });
+	}
+
+	using Broadphase::queryCollisionPairs;
+
+	// each pair is reported from the first cell their spans share, as in the spatial hash
+	template<typename Visitor>
+	bool visitPairs(Visitor&& visit) const {
+		BROADPHASE_STATS_SCOPE();
+		build();
+		const int* minX = entries.minX();
+		const int* minY = entries.minY();
+		for (int y = 0; y < rows; ++y) {
+			for (int x = 0; x < columns; ++x) {
+				const size_t cell = y * columns + x, last = starts[cell + 1];
+				BROADPHASE_COUNT(cells, 1);
+				BROADPHASE_OCCUPANCY(last - starts[cell]);
+				for (size_t i = starts[cell]; i + 1 < last; ++i) {
+					const int x0 = column(minX[i]), y0 = row(minY[i]);
+					const bool more = entries.forEachAABBHit(i + 1, last, entries[i]->aabb, [&](const size_t j) {
+						if (std::max(x0, column(minX[j])) != x || std::max(y0, row(minY[j])) != y) {
+							BROADPHASE_COUNT(duplicates, 1);
+							return true;
+						}
+						return visit(entries[i], entries[j]);
+					});
+					if (!more) return false;
+				}
+			}
+		}
+		return true;
+	}
+
+	void queryCollisionPairs(std::vector<ProxyPair>& pairs) const override {
+		visitPairs([&](Proxy* a, Proxy* b) { pairs.emplace_back(a, b); return true; });
+	}
+
+	bool queryCollisionPairs(PairCallback callback, void* context) const override {
+		return visitPairs([=](Proxy* a, Proxy* b) { return callback(a, b, context); });
+	}
+};
+
+#endif // UNIFORMGRID_HPP
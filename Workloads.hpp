@@ -0,0 +1,274 @@
+/**
+ * @file Workloads.hpp
+ * @brief Implements seeded benchmark scenarios of proxy layouts and their motion.
+ * @section License
+ * Copyright (C) 2020 Robert Colton
+ * License pending. All rights reserved.
+ */
+
+#ifndef WORKLOADS_HPP
+#define WORKLOADS_HPP
+
+#include "AABB.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+/*
+ * A workload is a world, the proxies' starting boxes and how each of them moves per frame. Every
+ * generator draws from its own splitmix64 stream, so a seed gives the same scenario on every
+ * platform and standard library, and where a teleporter lands on a frame is hashed from the seed,
+ * the proxy and the frame, so frames can be replayed in any order.
+ */
+
+class WorkloadRandom {
+	uint64_t state;
+
+public:
+	explicit WorkloadRandom(const uint64_t seed): state(seed) {}
+
+	uint64_t next() {
+		uint64_t z = (state += 0x9E3779B97F4A7C15ull);
+		z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+		z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+		return z ^ (z >> 31);
+	}
+
+	// uniform in [low, high]
+	int range(const int low, const int high) {
+		return low + (int) (next() % (uint64_t) ((int64_t) high - low + 1));
+	}
+
+	// uniform in [0, 1)
+	double uniform() {
+		return (next() >> 11) * (1.0 / 9007199254740992.0);
+	}
+
+	double normal(const double mean, const double sigma) {
+		const double u = 1.0 - uniform(), v = uniform();
+		return mean + sigma * std::sqrt(-2.0 * std::log(u)) * std::cos(6.283185307179586 * v);
+	}
+};
+
+struct Workload {
+	enum Motion : uint8_t { Static, Linear, Teleport };
+
+	struct Mover {
+		int dx, dy;
+		Motion motion;
+	};
+
+	std::string name;
+	AABB world;
+	std::vector<AABB> aabbs;
+	std::vector<Mover> movers; // one per box
+	uint64_t seed;
+
+	Workload(const std::string& name, const int worldSize, const uint64_t seed):
+		name(name), world(0, 0, worldSize, worldSize), seed(seed) {}
+
+	size_t size() const { return aabbs.size(); }
+	bool isMoving(const size_t i) const { return movers[i].motion != Static; }
+
+	// where box i is after one more frame, given where it is now
+	AABB move(const size_t i, AABB aabb, const unsigned frame) const {
+		const Mover& mover = movers[i];
+		if (mover.motion == Teleport) {
+			WorkloadRandom random(seed ^ (i * 0xD6E8FEB86659FD93ull) ^ ((uint64_t) frame << 40));
+			aabb.setPosition(random.range(0, world.getWidth() - aabb.getWidth()),
+											 random.range(0, world.getHeight() - aabb.getHeight()));
+		} else if (mover.motion == Linear) {
+			aabb.setPosition(aabb.getX() + mover.dx, aabb.getY() + mover.dy);
+			aabb.warp(world);
+		}
+		return aabb;
+	}
+
+	/**
+	 * Counts from first to last in 1, 2, 5 steps per decade, for sweeping the proxy count. Pair each
+	 * count with scaledWorld() to keep the density of the default scenarios.
+	 */
+	static std::vector<size_t> sweepCounts(const size_t first = 1000, const size_t last = 1000000) {
+		std::vector<size_t> counts;
+		for (size_t decade = 1; decade <= last; decade *= 10) {
+			const size_t steps[] = { decade, decade * 2, decade * 5 };
+			for (auto count : steps)
+				if (count >= first && count <= last) counts.push_back(count);
+		}
+		return counts;
+	}
+
+	// the world size giving count proxies the density of 10,000 in a 1024 world
+	static int scaledWorld(const size_t count) {
+		return std::max(64, (int) std::lround(1024.0 * std::sqrt(count / 10000.0)));
+	}
+
+	// boxes of 4 to 32 spread evenly, all drifting with one of 32 shared velocities
+	static Workload uniform(const size_t count, const int worldSize = 1024, const uint64_t seed = 1) {
+		Workload workload("uniform", worldSize, seed);
+		WorkloadRandom random(seed);
+		const auto speeds = sharedSpeeds(random);
+		for (size_t i = 0; i < count; ++i) {
+			const int width = random.range(4, 32),
+								height = random.range(4, 32);
+			workload.add(AABB(random.range(-width, worldSize), random.range(-height, worldSize), width, height),
+									 speeds[i % speeds.size()]);
+		}
+		return workload;
+	}
+
+	// a cluster for every thousand boxes, each piled into a 64 square around a random center
+	static Workload sparse(const size_t count, const int worldSize = 1024, const uint64_t seed = 1) {
+		Workload workload("sparse", worldSize, seed);
+		WorkloadRandom random(seed);
+		const auto speeds = sharedSpeeds(random);
+		int cx = 0, cy = 0;
+		for (size_t i = 0; i < count; ++i) {
+			if (i % 1000 == 0) {
+				cx = random.range(0, worldSize);
+				cy = random.range(0, worldSize);
+			}
+			const int width = random.range(4, 32),
+								height = random.range(4, 32);
+			workload.add(AABB(cx + random.range(-std::min(32, width), 0),
+												cy + random.range(-std::min(32, height), 0),
+												width, height),
+									 speeds[i % speeds.size()]);
+		}
+		return workload;
+	}
+
+	// boxes normally distributed around a few centers, the spread of each cluster drawn at random
+	static Workload gaussian(const size_t count, const int worldSize = 1024, const uint64_t seed = 1,
+													 const int clusters = 16) {
+		Workload workload("gaussian", worldSize, seed);
+		WorkloadRandom random(seed);
+		const auto speeds = sharedSpeeds(random);
+		std::vector<double> centers;
+		for (int c = 0; c < clusters; ++c) {
+			centers.push_back(random.range(0, worldSize));
+			centers.push_back(random.range(0, worldSize));
+			centers.push_back(worldSize * (0.01 + 0.05 * random.uniform()));
+		}
+		for (size_t i = 0; i < count; ++i) {
+			const size_t c = (i % clusters) * 3;
+			const int width = random.range(4, 32),
+								height = random.range(4, 32);
+			workload.add(AABB(clamp(random.normal(centers[c], centers[c + 2]), worldSize) - width / 2,
+												clamp(random.normal(centers[c + 1], centers[c + 2]), worldSize) - height / 2,
+												width, height),
+									 speeds[i % speeds.size()]);
+		}
+		return workload;
+	}
+
+	/**
+	 * Pareto distributed sizes, mostly small with a long tail of large boxes, plus a few huge ones
+	 * spanning a quarter to half of the world that stress how backends handle oversized proxies.
+	 */
+	static Workload heavyTailed(const size_t count, const int worldSize = 1024, const uint64_t seed = 1,
+															const size_t huge = 4) {
+		Workload workload("heavy", worldSize, seed);
+		WorkloadRandom random(seed);
+		const auto speeds = sharedSpeeds(random);
+		for (size_t i = 0; i < count; ++i) {
+			int width, height;
+			if (i < huge) {
+				width = random.range(worldSize / 4, worldSize / 2);
+				height = random.range(worldSize / 4, worldSize / 2);
+			} else {
+				// alpha of 1.5 starting at 4
+				const double scale = std::pow(1.0 - random.uniform(), -1.0 / 1.5);
+				width = (int) std::min(worldSize / 2.0, 4 * scale * (0.5 + random.uniform())) + 1;
+				height = (int) std::min(worldSize / 2.0, 4 * scale * (0.5 + random.uniform())) + 1;
+			}
+			workload.add(AABB(random.range(-width, worldSize), random.range(-height, worldSize), width, height),
+									 speeds[i % speeds.size()]);
+		}
+		return workload;
+	}
+
+	// boxes queued along a few horizontal and vertical corridors and moving down their lengths
+	static Workload corridors(const size_t count, const int worldSize = 1024, const uint64_t seed = 1,
+														const int lanes = 8, const int laneWidth = 48) {
+		Workload workload("corridors", worldSize, seed);
+		WorkloadRandom random(seed);
+		for (size_t i = 0; i < count; ++i) {
+			const int lane = (int) (i % lanes);
+			const bool horizontal = lane % 2 == 0;
+			const int offset = (lane / 2 * 2 + 1) * worldSize / (lanes + 1),
+								width = random.range(4, 16),
+								height = random.range(4, 16),
+								along = random.range(0, worldSize),
+								across = offset + random.range(0, laneWidth - 16);
+			int speed = random.range(1, 5);
+			if (random.range(0, 1)) speed = -speed;
+			if (horizontal)
+				workload.add(AABB(along, across, width, height), Mover{speed, 0, Linear});
+			else
+				workload.add(AABB(across, along, width, height), Mover{0, speed, Linear});
+		}
+		return workload;
+	}
+
+	// a uniform world where only the given fraction of boxes ever moves
+	static Workload mostlyStatic(const size_t count, const int worldSize = 1024, const uint64_t seed = 1,
+															 const double moving = 0.02) {
+		Workload workload = uniform(count, worldSize, seed);
+		workload.name = "static";
+		WorkloadRandom random(seed + 1);
+		for (auto& mover : workload.movers)
+			if (random.uniform() >= moving) mover.motion = Static;
+		return workload;
+	}
+
+	// a uniform world where the given fraction of boxes jumps somewhere new every frame
+	static Workload teleporters(const size_t count, const int worldSize = 1024, const uint64_t seed = 1,
+															const double teleporting = 0.05) {
+		Workload workload = uniform(count, worldSize, seed);
+		workload.name = "teleport";
+		WorkloadRandom random(seed + 1);
+		for (auto& mover : workload.movers)
+			if (random.uniform() < teleporting) mover.motion = Teleport;
+		return workload;
+	}
+
+	static std::vector<std::string> names() {
+		return { "uniform", "sparse", "gaussian", "heavy", "corridors", "static", "teleport" };
+	}
+
+	// generates any of the above by its name, or an empty workload for an unknown one
+	static Workload create(const std::string& name, const size_t count, const int worldSize = 1024,
+												 const uint64_t seed = 1) {
+		if (name == "uniform") return uniform(count, worldSize, seed);
+		if (name == "sparse") return sparse(count, worldSize, seed);
+		if (name == "gaussian") return gaussian(count, worldSize, seed);
+		if (name == "heavy") return heavyTailed(count, worldSize, seed);
+		if (name == "corridors") return corridors(count, worldSize, seed);
+		if (name == "static") return mostlyStatic(count, worldSize, seed);
+		if (name == "teleport") return teleporters(count, worldSize, seed);
+		return Workload(name, worldSize, seed);
+	}
+
+private:
+	void add(const AABB& aabb, const Mover& mover) {
+		aabbs.push_back(aabb);
+		movers.push_back(mover);
+	}
+
+	static std::vector<Mover> sharedSpeeds(WorkloadRandom& random) {
+		std::vector<Mover> speeds;
+		for (int i = 0; i < 32; ++i)
+			speeds.push_back(Mover{random.range(-5, 5), random.range(-5, 5), Linear});
+		return speeds;
+	}
+
+	static int clamp(const double value, const int worldSize) {
+		return (int) std::max(0.0, std::min((double) worldSize, value));
+	}
+};
+
+#endif // WORKLOADS_HPP
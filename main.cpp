@@ -3,13 +3,25 @@
 #include "Quadtree.hpp"
 #include "SpatialHash.hpp"
 #include "PruneSweep.hpp"
+#include "DynamicAABBTree.hpp"
+#include "HierarchicalHash.hpp"
+#include "LinearBVH.hpp"
+#include "PairManager.hpp"
+#include "PartitionedBroadphase.hpp"
+#include "RangeBatch.hpp"
+#include "ThreadPool.hpp"
+#include "UniformGrid.hpp"
+#include "Workloads.hpp"
 
 #include <QtWidgets>
 
 #include <algorithm>
+#include <atomic>
 #include <cstdlib>
+#include <thread>
 
-static size_t allocated_bytes = 0;
+// counted atomically since the thread scaling benchmark allocates from several threads
+static std::atomic<size_t> allocated_bytes(0);
 
 void * operator new(size_t size)
 {
@@ -46,8 +58,6 @@ double benchmark(std::function<void(bool,bool)> fnc,
 	return avgTime;
 }
 
-using CreateRandom = std::function<std::vector<AABB>(void)>;
-
 QTableWidgetItem* createTimeCellItem(double time) {
 	auto item = new QTableWidgetItem();
 	item->setTextAlignment(Qt::AlignVCenter | Qt::AlignRight);
@@ -70,56 +80,54 @@ int main(int argc, char *argv[])
 	auto quadtree = new Quadtree();
 	const size_t quadtreeSize = allocated_bytes;
 	allocated_bytes = 0;
+	auto looseQuadtree = new Quadtree(1024, 1024, 8, 2.0f);
+	const size_t looseQuadtreeSize = allocated_bytes;
+	allocated_bytes = 0;
 	auto spatialHash = new SpatialHash();
 	const size_t spatialHashSize = allocated_bytes;
 	allocated_bytes = 0;
 	auto pruneSweep = new PruneSweep();
 	const size_t pruneSweepSize = allocated_bytes;
+	allocated_bytes = 0;
+	auto dynamicAABBTree = new DynamicAABBTree();
+	const size_t dynamicAABBTreeSize = allocated_bytes;
+	allocated_bytes = 0;
+	auto partitionedHash = new PartitionedBroadphase<SpatialHash>();
+	const size_t partitionedHashSize = allocated_bytes;
+	allocated_bytes = 0;
+	auto uniformGrid = new UniformGrid();
+	const size_t uniformGridSize = allocated_bytes;
+	allocated_bytes = 0;
+	auto linearBVH = new LinearBVH();
+	const size_t linearBVHSize = allocated_bytes;
+	allocated_bytes = 0;
+	auto hierarchicalHash = new HierarchicalHash();
+	const size_t hierarchicalHashSize = allocated_bytes;
 
 	QList<QPair<QString, QSharedPointer<Broadphase>>> bpis = {
 		{"Prune Sweep",QSharedPointer<Broadphase>(pruneSweep)},
 		{"Quadtree",QSharedPointer<Broadphase>(quadtree)},
+		{"Loose Quadtree",QSharedPointer<Broadphase>(looseQuadtree)},
 		{"Spatial Hash",QSharedPointer<Broadphase>(spatialHash)},
+		{"Dynamic AABB Tree",QSharedPointer<Broadphase>(dynamicAABBTree)},
+		{"Partitioned Spatial Hash",QSharedPointer<Broadphase>(partitionedHash)},
+		{"Uniform Grid",QSharedPointer<Broadphase>(uniformGrid)},
+		{"Linear BVH",QSharedPointer<Broadphase>(linearBVH)},
+		{"Hierarchical Hash",QSharedPointer<Broadphase>(hierarchicalHash)},
 	};
-	QList<size_t> base_sizes = { pruneSweepSize, quadtreeSize, spatialHashSize };
-
-	auto createRandomDense = []() {
-		std::vector<AABB> aabbs;
-		for (int i = 0; i < 10000; ++i) {
-			const int width = randomInt(4, 32),
-								height = randomInt(4, 32);
-			const auto aabb = AABB(randomInt(-width, 1024),
-														 randomInt(-height, 1024),
-														 width,
-														 height);
-			aabbs.emplace_back(aabb);
-		}
-		return aabbs;
-	};
+	QList<size_t> base_sizes = { pruneSweepSize, quadtreeSize, looseQuadtreeSize, spatialHashSize,
+															 dynamicAABBTreeSize, partitionedHashSize, uniformGridSize,
+															 linearBVHSize, hierarchicalHashSize };
 
-	auto createRandomSparse = [](){
-		std::vector<AABB> aabbs;
-		for (int c = 0; c < 10; ++c) {
-			int cx = randomInt(0, 1024);
-			int cy = randomInt(0, 1024);
-			for (int i = 0; i < 1000; ++i) {
-				const int width = randomInt(4, 32),
-									height = randomInt(4, 32);
-				const auto aabb = AABB(cx + randomInt(-std::min(32, width), 0),
-															 cy + randomInt(-std::min(32, height), 0),
-															 width, height);
-				aabbs.emplace_back(aabb);
-			}
-		}
-		return aabbs;
-	};
+	// the two scenarios the table compares, 10,000 boxes each
+	const Workload dense = Workload::uniform(10000), sparse = Workload::sparse(10000);
 
 	bmButton->connect(bmButton, &QAbstractButton::clicked, [&](){
 		QDialog benchmarkWindow(nullptr);
 		benchmarkWindow.setWindowFlags(launcher.windowFlags() & ~Qt::WindowContextHelpButtonHint);
 		benchmarkWindow.setWindowTitle("Benchmark");
 
-		QTableWidget* benchmarkTable = new QTableWidget(bpis.size() * 2 + 2, 6);
+		QTableWidget* benchmarkTable = new QTableWidget(bpis.size() * 2 + 2, 8);
 		benchmarkTable->horizontalHeader()->setSectionResizeMode(QHeaderView::ResizeToContents);
 		benchmarkTable->verticalHeader()->setSectionResizeMode(QHeaderView::ResizeMode::ResizeToContents);
 		benchmarkTable->setSizeAdjustPolicy(QAbstractScrollArea::AdjustToContents);
@@ -127,8 +135,14 @@ int main(int argc, char *argv[])
 
 		benchmarkTable->setVerticalHeaderItem(0, new QTableWidgetItem("Dense"));
 		benchmarkTable->setVerticalHeaderItem(bpis.size() + 1, new QTableWidgetItem("Sparse"));
-		benchmarkTable->setSpan(0,0,1,6);
-		benchmarkTable->setSpan(bpis.size() + 1,0,1,6);
+		benchmarkTable->setSpan(0,0,1,8);
+		benchmarkTable->setSpan(bpis.size() + 1,0,1,8);
+
+		// checks that must hold in release builds too, reported once the table is filled
+		QStringList failures;
+		auto check = [&](bool ok, const QString& failure) {
+			if (!ok) failures.append(failure);
+		};
 
 		for (int i = 0; i < bpis.size(); ++i) {
 			auto bpi = bpis[i];
@@ -136,10 +150,34 @@ int main(int argc, char *argv[])
 			benchmarkTable->setVerticalHeaderItem(bpis.size() + i + 2, new QTableWidgetItem(bpi.first));
 
 			auto benchmarkBroadphase =
-				[&](CreateRandom createRandom, int row) {
+				[&](const Workload& workload, int row) {
+					const auto& aabbs = workload.aabbs;
+					// the proxies the backend accepted and the workload box each one came from
 					std::vector<Broadphase::Proxy*> proxies;
-					std::vector<AABB> aabbs;
-					std::vector<std::pair<int,int>> speeds;
+					std::vector<size_t> boxes;
+					auto fill = [&](std::function<Broadphase::Proxy*(const AABB&)> add) {
+						std::vector<Broadphase::Proxy*>().swap(proxies);
+						boxes.clear();
+						for (size_t i = 0; i < aabbs.size(); ++i) {
+							auto proxy = add(aabbs[i]);
+							if (!proxy) continue;
+							proxies.push_back(proxy);
+							boxes.push_back(i);
+						}
+					};
+					// the uniform grid and linear BVH are rebuilt once per frame instead of on every move,
+					// sweep and prune merges its added boxes at the same points, and the partitioned
+					// backend is told where each frame ends so idle proxies fall asleep
+					const auto grid = dynamic_cast<UniformGrid*>(bpi.second.data());
+					const auto bvh = dynamic_cast<LinearBVH*>(bpi.second.data());
+					const auto sweep = dynamic_cast<PruneSweep*>(bpi.second.data());
+					const auto partitioned = dynamic_cast<PartitionedBroadphase<SpatialHash>*>(bpi.second.data());
+					auto rebuild = [&]() {
+						if (grid) grid->rebuild();
+						if (bvh) bvh->rebuild();
+						if (sweep) sweep->rebuild();
+						if (partitioned) partitioned->step();
+					};
 					size_t memory = 0;
 					double insert = benchmark(
 						[&](bool, bool){
@@ -147,46 +185,64 @@ int main(int argc, char *argv[])
 							for (const auto& aabb : aabbs) {
 								bpi.second->addProxy(aabb);
 							}
+							rebuild();
 							memory = allocated_bytes;
 						},
-						[&](bool firstRun, bool){
-							if (firstRun) {
-								aabbs = createRandom();
-								for (int i = 0; i < 32; ++i)
-									speeds.push_back({randomInt(-5,5),randomInt(-5,5)});
-							}
+						[&](bool, bool){
 							bpi.second->clear();
 						}
 					);
-					double query = benchmark([=](bool, bool) {
+					// a soak of queries must leave the spatial hash's cell table untouched
+					const auto hash = dynamic_cast<SpatialHash*>(bpi.second.data());
+					const size_t cellCount = hash ? hash->getCellCount() : 0;
+					std::vector<Broadphase::Proxy*> hits;
+					double query = benchmark([&](bool, bool) {
 							for (int i = 0; i < 100; ++i) {
+								hits.clear();
 								bpi.second->queryRange(randomInt(0, 1024),
 																			 randomInt(0, 1024),
-																			 randomInt(2, 240));
+																			 randomInt(2, 240), hits);
 							}
 						}
 					);
+					check(!hash || hash->getCellCount() == cellCount,
+								bpi.first + ": queries changed the cell count from " + QString::number(cellCount) +
+								" to " + QString::number(hash ? hash->getCellCount() : 0));
 					double update = benchmark([&](bool, bool) {
 							for (int i = 0; i < 60; ++i) {
-								size_t aabbId = aabbs.size();
-								for (auto proxy : proxies) {
-									auto aabb = proxy->aabb;
-									const auto& speed = speeds[--aabbId % speeds.size()];
-									aabb.setPosition(aabb.getX() + speed.first,
-																	 aabb.getY() + speed.second);
-									aabb.warp(AABB(0, 0, 1024, 1024));
-									bpi.second->updateProxy(proxy, aabb);
-								}
+								for (size_t j = 0; j < proxies.size(); ++j)
+									bpi.second->updateProxy(proxies[j], workload.move(boxes[j], proxies[j]->aabb, i));
+								rebuild();
 							}
 						},
 						[&](bool,bool){
 							bpi.second->clear();
-							std::vector<Broadphase::Proxy*>().swap(proxies);
-							for (const auto& aabb : aabbs) {
-								auto proxy = bpi.second->addProxy(aabb);
-								if (!proxy) break; // TODO: Throw out after prune juice
-								proxies.push_back(proxy);
+							fill([&](const AABB& aabb) { return bpi.second->addProxy(aabb); });
+						}
+					);
+					// the same motion through a pair manager, which only retests what moved
+					PairManager manager(*bpi.second);
+					std::vector<PairManager::Contact> began, ended;
+					double contacts = benchmark([&](bool, bool) {
+							for (int i = 0; i < 60; ++i) {
+								for (size_t j = 0; j < proxies.size(); ++j)
+									manager.updateProxy(proxies[j], workload.move(boxes[j], proxies[j]->aabb, i));
+								began.clear();
+								ended.clear();
+								manager.update(began, ended);
+								rebuild();
 							}
+						},
+						[&](bool,bool){
+							manager.clear();
+							fill([&](const AABB& aabb) { return manager.addProxy(aabb); });
+							manager.update(began, ended);
+						}
+					);
+					std::vector<Broadphase::ProxyPair> pairs;
+					double pairing = benchmark([&](bool, bool) {
+							pairs.clear();
+							bpi.second->queryCollisionPairs(pairs);
 						}
 					);
 					double clear = benchmark(
@@ -205,11 +261,12 @@ int main(int argc, char *argv[])
 								bpi.second->removeProxy(proxy);
 						},
 						[&](bool, bool){
-							std::vector<Broadphase::Proxy*>().swap(proxies);
-							for (const auto& aabb : aabbs)
-								proxies.push_back(bpi.second->addProxy(aabb));
+							fill([&](const AABB& aabb) { return bpi.second->addProxy(aabb); });
 						}
 					);
+					check(!hash || hash->getCellCount() == 0,
+								bpi.first + ": " + QString::number(hash ? hash->getCellCount() : 0) +
+								" cells left after removing every proxy");
 
 					memory += base_sizes[i];
 					auto memoryItem = new QTableWidgetItem(benchmarkTable->locale().formattedDataSize(memory));
@@ -217,25 +274,99 @@ int main(int argc, char *argv[])
 					benchmarkTable->setItem(row, 0, memoryItem);
 					benchmarkTable->setItem(row, 1, createTimeCellItem(insert));
 					benchmarkTable->setItem(row, 2, createTimeCellItem(query));
-					benchmarkTable->setItem(row, 3, createTimeCellItem(update));
-					benchmarkTable->setItem(row, 4, createTimeCellItem(clear));
-					benchmarkTable->setItem(row, 5, createTimeCellItem(remove));
+					benchmarkTable->setItem(row, 3, createTimeCellItem(pairing));
+					benchmarkTable->setItem(row, 4, createTimeCellItem(update));
+					benchmarkTable->setItem(row, 5, createTimeCellItem(contacts));
+					benchmarkTable->setItem(row, 6, createTimeCellItem(clear));
+					benchmarkTable->setItem(row, 7, createTimeCellItem(remove));
 				};
 
-			benchmarkBroadphase(createRandomDense, i + 1);
-			benchmarkBroadphase(createRandomSparse, bpis.size() + i + 2);
+			benchmarkBroadphase(dense, i + 1);
+			benchmarkBroadphase(sparse, bpis.size() + i + 2);
 		}
 
 		//benchmarkTable->setSortingEnabled(true);
-		benchmarkTable->setHorizontalHeaderLabels({"Memory", "Insert", "Query", "Update", "Clear", "Remove"});
+		benchmarkTable->setHorizontalHeaderLabels({"Memory", "Insert", "Query", "Pairs", "Update", "Contacts", "Clear", "Remove"});
 
 		QVBoxLayout* bmlayout = new QVBoxLayout();
 		bmlayout->addWidget(benchmarkTable);
 		benchmarkWindow.setLayout(bmlayout);
 
+		if (!failures.isEmpty())
+			QMessageBox::critical(&benchmarkWindow, "Benchmark Failed", failures.join("\n"));
 		benchmarkWindow.exec();
 	});
 
+	QPushButton *scalingButton = new QPushButton("Thread Scaling");
+	vbl->addWidget(scalingButton);
+	scalingButton->connect(scalingButton, &QAbstractButton::clicked, [&](){
+		QDialog scalingWindow(nullptr);
+		scalingWindow.setWindowFlags(launcher.windowFlags() & ~Qt::WindowContextHelpButtonHint);
+		scalingWindow.setWindowTitle("Thread Scaling");
+
+		std::vector<unsigned> threadCounts;
+		const unsigned maxThreads = std::max(1u, std::thread::hardware_concurrency());
+		for (unsigned threads = 1; threads < maxThreads; threads *= 2)
+			threadCounts.push_back(threads);
+		threadCounts.push_back(maxThreads);
+
+		QTableWidget* scalingTable = new QTableWidget(threadCounts.size(), 4);
+		scalingTable->horizontalHeader()->setSectionResizeMode(QHeaderView::ResizeToContents);
+		scalingTable->verticalHeader()->setSectionResizeMode(QHeaderView::ResizeMode::ResizeToContents);
+		scalingTable->setSizeAdjustPolicy(QAbstractScrollArea::AdjustToContents);
+		scalingTable->setEditTriggers(QAbstractItemView::NoEditTriggers);
+		scalingTable->setHorizontalHeaderLabels({"Dense Hash Pairs", "Sparse Hash Pairs",
+																						 "Hash Batch Queries", "Quadtree Batch Queries"});
+		for (size_t row = 0; row < threadCounts.size(); ++row)
+			scalingTable->setVerticalHeaderItem(row, new QTableWidgetItem(QString::number(threadCounts[row]) + " Threads"));
+
+		// fills a column with the time taken at each thread count and the speedup over one thread
+		auto benchmarkScaling = [&](int column, std::function<void(ThreadPool&)> fnc) {
+			double serial = 0;
+			for (size_t row = 0; row < threadCounts.size(); ++row) {
+				ThreadPool threads(threadCounts[row]);
+				double time = benchmark([&](bool, bool) { fnc(threads); });
+				if (row == 0) serial = time;
+				auto item = createTimeCellItem(time);
+				item->setText(item->text() + QString(" (%1x)").arg(time > 0 ? serial / time : 1.0, 0, 'f', 2));
+				scalingTable->setItem(row, column, item);
+			}
+		};
+
+		std::vector<Broadphase::ProxyPair> pairs;
+		srand(1);
+		SpatialHash denseHash;
+		for (const auto& aabb : dense.aabbs)
+			denseHash.addProxy(aabb);
+		benchmarkScaling(0, [&](ThreadPool& threads) {
+			pairs.clear();
+			denseHash.queryCollisionPairs(pairs, threads);
+		});
+		SpatialHash sparseHash;
+		for (const auto& aabb : sparse.aabbs)
+			sparseHash.addProxy(aabb);
+		benchmarkScaling(1, [&](ThreadPool& threads) {
+			pairs.clear();
+			sparseHash.queryCollisionPairs(pairs, threads);
+		});
+
+		// one query per agent, all against the dense world
+		Quadtree quadtree;
+		for (auto proxy : denseHash.getProxies())
+			quadtree.addProxy(proxy->aabb);
+		RangeBatch batch;
+		for (int i = 0; i < 10000; ++i)
+			batch.addQuery(randomInt(0, 1024), randomInt(0, 1024), randomInt(2, 64));
+		benchmarkScaling(2, [&](ThreadPool& threads) { batch.run(denseHash, threads); });
+		benchmarkScaling(3, [&](ThreadPool& threads) { batch.run(quadtree, threads); });
+
+		QVBoxLayout* scalingLayout = new QVBoxLayout();
+		scalingLayout->addWidget(scalingTable);
+		scalingWindow.setLayout(scalingLayout);
+
+		scalingWindow.exec();
+	});
+
 	foreach (auto bp, bpis) {
 		QPushButton *bpButton = new QPushButton(bp.first);
 		bpButton->connect(bpButton, &QAbstractButton::clicked, [=](){